@@ -0,0 +1,156 @@
+// Scripted Emacspeak client for the end-to-end latency benchmark. It
+// connects to a running server and replays the traffic a user generates:
+// keystroke echo while typing, reading the buffer line by line, and
+// dumping whole paragraphs. Every burst starts with s, as Emacspeak sends
+// it, so each measures a fresh utterance rather than queueing behind the
+// last. The server times each stage and prints the percentiles when it
+// exits; make bench runs both and stops the server afterwards.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define CONNECT_ATTEMPTS 50  // The server may still be starting; 100 ms apart
+#define KEYSTROKES 120
+#define KEYSTROKE_GAP_MS 60  // A fast typist
+#define LINE_READS 25
+#define LINE_GAP_MS 300
+#define BUFFER_DUMPS 5
+#define BUFFER_DUMP_LINES 40
+#define BUFFER_GAP_MS 2000
+
+static const char typed[] = "the quick brown fox jumps over the lazy dog while emacspeak echoes every key ";
+
+static const char *const buffer_lines[] = {
+    "omnivox speaks the Emacspeak server protocol over TCP and stdin.",
+    "Each q command adds a fragment and d hands the batch to DECtalk.",
+    "Speech is split at sentence ends so the first one plays at once.",
+    "Auditory icons and tones are mixed over speech as it plays.",
+    "A stop silences playback within a buffer or two.",
+};
+
+void sleep_ms(long ms) {
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+}
+
+int connect_server(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS; attempt++) {
+        struct addrinfo *addresses;
+        if (getaddrinfo(host, port, &hints, &addresses) == 0) {
+            for (struct addrinfo *a = addresses; a; a = a->ai_next) {
+                int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                    freeaddrinfo(addresses);
+                    return fd;
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            freeaddrinfo(addresses);
+        }
+        sleep_ms(100);
+    }
+    return -1;
+}
+
+int send_text(int fd, const char *text) {
+    size_t len = strlen(text);
+    while (len > 0) {
+        ssize_t sent = write(fd, text, len);
+        if (sent < 0) {
+            perror("write");
+            return -1;
+        }
+        text += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Each key stops the previous echo and speaks the new letter
+int keystroke_echo(int fd) {
+    char line[16];
+    for (int i = 0; i < KEYSTROKES; i++) {
+        char c = typed[(size_t)i % (sizeof(typed) - 1)];
+        snprintf(line, sizeof(line), "s\nl %c\n", c == ' ' ? 'a' : c);
+        if (send_text(fd, line) != 0) {
+            return -1;
+        }
+        sleep_ms(KEYSTROKE_GAP_MS);
+    }
+    return 0;
+}
+
+// Moving to the next line interrupts the last one and reads the new one
+int line_reads(int fd) {
+    char line[256];
+    size_t count = sizeof(buffer_lines) / sizeof(buffer_lines[0]);
+    for (int i = 0; i < LINE_READS; i++) {
+        snprintf(line, sizeof(line), "s\nq {%s}\nd\n", buffer_lines[(size_t)i % count]);
+        if (send_text(fd, line) != 0) {
+            return -1;
+        }
+        sleep_ms(LINE_GAP_MS);
+    }
+    return 0;
+}
+
+// A region or buffer read arrives as many q fragments and one d
+int buffer_dumps(int fd) {
+    char line[256];
+    size_t count = sizeof(buffer_lines) / sizeof(buffer_lines[0]);
+    for (int i = 0; i < BUFFER_DUMPS; i++) {
+        if (send_text(fd, "s\n") != 0) {
+            return -1;
+        }
+        for (int j = 0; j < BUFFER_DUMP_LINES; j++) {
+            snprintf(line, sizeof(line), "q {%s}\n", buffer_lines[(size_t)(i + j) % count]);
+            if (send_text(fd, line) != 0) {
+                return -1;
+            }
+        }
+        if (send_text(fd, "d\n") != 0) {
+            return -1;
+        }
+        sleep_ms(BUFFER_GAP_MS);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s HOST PORT\n", argv[0]);
+        return 2;
+    }
+    int fd = connect_server(argv[1], argv[2]);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to %s port %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    static const struct {
+        const char *name;
+        int (*run)(int fd);
+    } phases[] = {
+        { "keystroke echo", keystroke_echo },
+        { "line reads", line_reads },
+        { "buffer dumps", buffer_dumps },
+    };
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        printf("latency: %s\n", phases[i].name);
+        fflush(stdout);
+        if (phases[i].run(fd) != 0) {
+            close(fd);
+            return 1;
+        }
+    }
+    send_text(fd, "s\n");
+    close(fd);
+    return 0;
+}
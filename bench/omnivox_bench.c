@@ -0,0 +1,502 @@
+// Benchmarks. omnivox.c is built into this program with its main renamed,
+// so each benchmark times the server's own code on synthetic input. make
+// bench runs them all, ./omnivox_bench NAME runs one.
+
+// omnivox.c needs POSIX and BSD calls that C11 leaves out, and its own
+// request comes after the headers included here
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define main omnivox_main
+#include "../omnivox.c"
+#undef main
+
+#define PARSE_ROUNDS 200
+#define PARSE_BATCH 1024  // Commands timed between flushes of the queue they fill
+#define LINES_INPUT_BYTES (16 * 1024 * 1024)
+#define LINES_PASSES 5
+#define ENGINE_UTTERANCES 48
+#define ENGINE_TIMEOUT_MS 120000
+#define RENDER_SECONDS 20  // Output rendered per configuration
+#define READ_MINUTES 10
+#define READ_BUDGET_MS "660000"  // Room for the whole read, so none of it waits as text
+#define BENCH_MIX_RATE 48000
+
+double seconds_since(uint64_t start) {
+    return (double)(uv_hrtime() - start) / 1e9;
+}
+
+// Sets up the queues and pools without DECtalk or a sink
+int start_bench_queues(void) {
+    char *options[] = { "omnivox_bench", "--sink", "null", "--no-letter-bank", "--no-cache" };
+    if (parse_options((int)(sizeof(options) / sizeof(options[0])), options) != 0 || init_queues() != 0) {
+        fprintf(stderr, "Cannot set up the queues\n");
+        return -1;
+    }
+    trace_register_thread("bench");
+    return 0;
+}
+
+line_buffer_t bench_lines_buffer;
+
+// Feeds one protocol line as if a client had just sent it
+void send_line(const char *line) {
+    static char buffer[4096];
+    size_t len = strlen(line);
+    if (len + 1 > sizeof(buffer)) {
+        fprintf(stderr, "Benchmark line too long\n");
+        exit(2);
+    }
+    memcpy(buffer, line, len);
+    buffer[len] = '\n';
+    line_received_at = uv_hrtime();
+    feed_lines(&bench_lines_buffer, buffer, len + 1);
+}
+
+// Starts the pipeline as main does, with the given options after the
+// program name
+void start_bench_pipeline(char **options, int count) {
+    if (parse_options(count, options) != 0) {
+        exit(2);
+    }
+    trace_register_thread("bench");
+    loop = uv_default_loop();
+    if (start_pipeline() != 0) {
+        fprintf(stderr, "Pipeline did not start\n");
+        exit(1);
+    }
+}
+
+void stop_bench_pipeline(void) {
+    stop_pipeline();
+    free_pipeline();
+    free(bench_lines_buffer.data);
+}
+
+// Every queued request has been taken by an engine and finished
+int synthesis_done(void) {
+    uv_mutex_lock(&synth_queue_mutex);
+    int queued = synth_queue_size > 0;
+    uint64_t taken = next_ticket;
+    uv_mutex_unlock(&synth_queue_mutex);
+    uv_mutex_lock(&reorder_mutex);
+    int done = !queued && publish_ticket == taken;
+    uv_mutex_unlock(&reorder_mutex);
+    return done;
+}
+
+// Every utterance synthesized and its audio played
+int engines_finished(unsigned long utterances) {
+    unsigned long done = 0;
+    for (int i = 0; i < engine_count; i++) {
+        done += atomic_load(&engines[i].utterances);
+    }
+    return done >= utterances && audio_ring_depth(&audio_ring) == 0 && atomic_load(&queued_audio_frames) == 0;
+}
+
+// Protocol lines as Emacspeak sends them. Each is parsed in place, so it
+// is copied into a scratch line before every dispatch; the copy is timed
+// alone first and subtracted.
+void bench_parse(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    static const char *const lines[] = {
+        "q {Emacspeak reads this line of the buffer out loud}",
+        "c {[:np]}",
+        "d",
+        "tts_say {Saved file omnivox.c}",
+        "tts_set_speech_rate 350",
+        "tts_set_punctuations some",
+        "tts_sync_state all 0 0 1 350",
+        "version",
+    };
+    if (start_bench_queues() != 0) {
+        return;
+    }
+    static char scratch[MAX_BATCH_LENGTH];
+    printf("%-56s %10s %12s\n", "command", "ns", "per second");
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        size_t len = strlen(lines[l]);
+        uint64_t copy_ns = 0, total_ns = 0;
+        for (int round = 0; round < PARSE_ROUNDS; round++) {
+            uint64_t start = uv_hrtime();
+            for (int i = 0; i < PARSE_BATCH; i++) {
+                memcpy(scratch, lines[l], len + 1);
+            }
+            copy_ns += uv_hrtime() - start;
+
+            start = uv_hrtime();
+            for (int i = 0; i < PARSE_BATCH; i++) {
+                memcpy(scratch, lines[l], len + 1);
+                dispatch_command(scratch);
+            }
+            total_ns += uv_hrtime() - start;
+            discard_pending_speech();
+            flush_synth_queue();
+        }
+        double count = (double)PARSE_ROUNDS * PARSE_BATCH;
+        double ns = (double)(total_ns > copy_ns ? total_ns - copy_ns : 0) / count;
+        printf("%-56s %10.1f %12.0f\n", lines[l], ns, ns > 0.0 ? 1e9 / ns : 0.0);
+    }
+}
+
+// Fills buffer with lines of the given lengths in turn, newline included.
+// tts_set_speech_rate reads only its first argument, so the padding after
+// it costs the dispatcher nothing and the time is the line assembler's.
+size_t fill_lines(char *buffer, size_t size, const size_t *lengths, size_t count, size_t *lines) {
+    static const char prefix[] = "tts_set_speech_rate 350";
+    size_t used = 0;
+    *lines = 0;
+    for (size_t i = 0; used + lengths[i % count] <= size; i++) {
+        size_t len = lengths[i % count];
+        memcpy(buffer + used, prefix, sizeof(prefix) - 1);
+        for (size_t j = sizeof(prefix) - 1; j < len - 1; j++) {
+            buffer[used + j] = j % 8 == 0 ? ' ' : 'x';
+        }
+        buffer[used + len - 1] = '\n';
+        used += len;
+        (*lines)++;
+    }
+    return used;
+}
+
+// Throughput of feed_lines over multi-megabyte input arriving in
+// READ_BUFFER_SIZE reads, as on_read sees it, for short command lines and
+// for long lines that span many reads.
+void bench_lines(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    static const size_t short_lines[] = { 24, 40, 64, 120 };
+    static const size_t long_lines[] = { 1000, 16 * 1024, 100 * 1000, 700 * 1000 };
+    static const struct {
+        const char *name;
+        const size_t *lengths;
+        size_t count;
+    } inputs[] = {
+        { "short lines (24-120 bytes)", short_lines, sizeof(short_lines) / sizeof(short_lines[0]) },
+        { "long lines (1 KB-700 KB)", long_lines, sizeof(long_lines) / sizeof(long_lines[0]) },
+    };
+    if (start_bench_queues() != 0) {
+        return;
+    }
+    char *input = malloc(LINES_INPUT_BYTES);
+    char *work = malloc(LINES_INPUT_BYTES);
+    line_buffer_t lines = { 0 };
+    if (!input || !work) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+    printf("%-28s %10s %10s %14s\n", "input", "MB", "MB/s", "lines/s");
+    for (size_t n = 0; n < sizeof(inputs) / sizeof(inputs[0]); n++) {
+        size_t count;
+        size_t bytes = fill_lines(input, LINES_INPUT_BYTES, inputs[n].lengths, inputs[n].count, &count);
+        uint64_t total_ns = 0;
+        for (int pass = 0; pass < LINES_PASSES; pass++) {
+            // feed_lines terminates lines in place, so each pass starts from a fresh copy
+            memcpy(work, input, bytes);
+            uint64_t start = uv_hrtime();
+            for (size_t done = 0; done < bytes; done += READ_BUFFER_SIZE) {
+                size_t len = bytes - done < READ_BUFFER_SIZE ? bytes - done : READ_BUFFER_SIZE;
+                feed_lines(&lines, work + done, len);
+            }
+            total_ns += uv_hrtime() - start;
+        }
+        double seconds = (double)total_ns / 1e9;
+        double mb = (double)bytes / (1024.0 * 1024.0);
+        printf("%-28s %10.1f %10.0f %14.0f\n", inputs[n].name, mb, mb * LINES_PASSES / seconds,
+               (double)count * LINES_PASSES / seconds);
+    }
+    free(lines.data);
+    free(work);
+    free(input);
+}
+
+// Synthesis throughput with N engines: a burst of independent
+// utterances, none cached, against an unthrottled null sink so playback
+// never holds synthesis back. make bench runs it once per engine count,
+// each in a fresh process.
+void bench_engines(int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: omnivox_bench engines N\n");
+        exit(2);
+    }
+    char *options[] = { "omnivox_bench", "--sink", "null", "--unthrottled", "--no-cache", "--no-split",
+                        "--no-letter-bank", "--engines", argv[0] };
+    start_bench_pipeline(options, (int)(sizeof(options) / sizeof(options[0])));
+
+    char line[512];
+    uint64_t start = uv_hrtime();
+    for (int i = 0; i < ENGINE_UTTERANCES; i++) {
+        snprintf(line, sizeof(line),
+                 "tts_say {Utterance %d: the quick brown fox jumps over the lazy dog, "
+                 "and the five boxing wizards jump quickly past the river bank.}", i);
+        send_line(line);
+    }
+    while (!engines_finished(ENGINE_UTTERANCES)) {
+        if (seconds_since(start) * 1000.0 > ENGINE_TIMEOUT_MS) {
+            fprintf(stderr, "Synthesis did not finish\n");
+            exit(1);
+        }
+        uv_sleep(1);
+    }
+    double wall = seconds_since(start);
+    uint64_t busy = 0;
+    for (int i = 0; i < engine_count; i++) {
+        busy += atomic_load(&engines[i].busy_ns);
+    }
+    printf("%d engines: %d utterances in %.3f s, %.1f utterances/s, parallelism %.2f\n", engine_count,
+           ENGINE_UTTERANCES, wall, ENGINE_UTTERANCES / wall, (double)busy / 1e9 / wall);
+
+    stop_bench_pipeline();
+}
+
+// One second of a 440 Hz tone at DECtalk's rate, queued over and over
+int16_t bench_speech[DECTALK_SAMPLE_RATE];
+
+void fill_bench_speech(void) {
+    for (int i = 0; i < DECTALK_SAMPLE_RATE; i++) {
+        bench_speech[i] = (int16_t)(12000.0 * sin(2.0 * RESAMPLE_PI * 440.0 * i / DECTALK_SAMPLE_RATE));
+    }
+}
+
+// Keeps a couple of items of speech queued, as a long read would
+void keep_speech_queued(void) {
+    reclaim_audio_items();
+    while (audio_ring_depth(&audio_ring) < 2) {
+        audio_item_t item = {
+            .source = SOURCE_PCM,
+            .data = bench_speech,
+            .frames = DECTALK_SAMPLE_RATE,
+            .gain = { 1.0f, 1.0f },
+            .generation = atomic_load(&playback_generation),
+            .sound_frame = -1,
+            .resident = 1
+        };
+        if (audio_ring_push(&audio_ring, &item) != 0) {
+            return;
+        }
+        atomic_fetch_add(&queued_audio_frames, item.frames);
+    }
+}
+
+// Renders RENDER_SECONDS of output a sink buffer at a time and returns
+// the CPU time per second of audio in ms
+double time_render(unsigned int rate) {
+    static float out[FRAMES_PER_BUFFER * OUTPUT_CHANNELS];
+    uint64_t total_ns = 0;
+    uint64_t frames = (uint64_t)rate * RENDER_SECONDS;
+    for (uint64_t done = 0; done < frames; done += FRAMES_PER_BUFFER) {
+        keep_speech_queued();
+        uint64_t start = uv_hrtime();
+        render_audio(out, FRAMES_PER_BUFFER);
+        total_ns += uv_hrtime() - start;
+    }
+    return (double)total_ns / 1e6 / RENDER_SECONDS;
+}
+
+// Cost of producing output at common device rates from queued speech:
+// the int16 conversion alone at DECtalk's own rate, then the polyphase
+// resampler at each quality.
+void bench_resample(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    static const unsigned int rates[] = { 22050, 44100, 48000 };
+    static const struct {
+        const char *name;
+        int taps;
+    } qualities[] = { { "low", 8 }, { "medium", 16 }, { "high", 32 } };
+    if (start_bench_queues() != 0) {
+        return;
+    }
+    fill_bench_speech();
+    output_rate = DECTALK_SAMPLE_RATE;
+    resampler_init(output_rate);
+    printf("%-8s %-8s %6s %22s\n", "rate", "quality", "taps", "ms CPU per s of audio");
+    printf("%-8u %-8s %6s %22.3f\n", output_rate, "none", "-", time_render(output_rate));
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+            resample_taps = qualities[q].taps;
+            output_rate = rates[r];
+            if (resampler_init(output_rate) != 0) {
+                continue;
+            }
+            printf("%-8u %-8s %6d %22.3f\n", output_rate, qualities[q].name, resampler.taps,
+                   time_render(output_rate));
+        }
+    }
+    free(resampler.coeffs);
+}
+
+// Resident set size in bytes, or 0 where /proc is not available
+size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0, resident = 0;
+    if (!statm) {
+        return 0;
+    }
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Queues a READ_MINUTES read as Emacspeak would send a buffer, lets it
+// synthesize into an audio budget big enough to hold it all, and reports
+// what the queued audio costs against the stereo float it used to be.
+void bench_memory(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    char *options[] = { "omnivox_bench", "--sink", "null", "--no-cache", "--no-letter-bank",
+                        "--audio-budget-ms", READ_BUDGET_MS };
+    size_t before = resident_bytes();
+    start_bench_pipeline(options, (int)(sizeof(options) / sizeof(options[0])));
+    size_t started = resident_bytes();
+
+    // About six characters per word at the default rate in words per minute
+    static const char sentence[] = "The quick brown fox jumps over the lazy dog by the river. ";
+    size_t text_bytes = (size_t)READ_MINUTES * DEFAULT_SPEECH_RATE * 6;
+    char line[sizeof(sentence) + 8];
+    uint64_t start = uv_hrtime();
+    for (size_t sent = 0; sent < text_bytes; sent += sizeof(sentence) - 1) {
+        snprintf(line, sizeof(line), "q {%s}", sentence);
+        send_line(line);
+    }
+    send_line("d");
+    while (!synthesis_done()) {
+        if (seconds_since(start) * 1000.0 > ENGINE_TIMEOUT_MS) {
+            fprintf(stderr, "Synthesis did not finish\n");
+            exit(1);
+        }
+        uv_sleep(10);
+    }
+    size_t queued = resident_bytes();
+
+    double seconds = (double)atomic_load(&queued_audio_frames) / DECTALK_SAMPLE_RATE;
+    size_t blocks = atomic_load(&pcm_pool.in_use);
+    double pcm_mb = (double)(blocks * pcm_pool.stride) / (1024.0 * 1024.0);
+    double float_mb = seconds * DECTALK_SAMPLE_RATE * OUTPUT_CHANNELS * sizeof(float) / (1024.0 * 1024.0);
+    printf("text: %zu KB queued as q fragments\n", text_bytes / 1024);
+    printf("audio queued: %.1f s in %zu pool blocks, %.1f MB (%.1f KB per second)\n", seconds, blocks, pcm_mb,
+           seconds > 0.0 ? pcm_mb * 1024.0 / seconds : 0.0);
+    printf("as stereo float it would take %.1f MB\n", float_mb);
+    if (before > 0) {
+        printf("resident: %.1f MB at start, +%.1f MB with the pools sized for the budget, "
+               "+%.1f MB with the read queued\n",
+               (double)before / (1024.0 * 1024.0), (double)(started - before) / (1024.0 * 1024.0),
+               (double)(queued - started) / (1024.0 * 1024.0));
+    }
+
+    send_line("s");
+    stop_bench_pipeline();
+}
+
+// Mixer cost as sources are added over speech: one buffer of speech is
+// rendered once, then each configuration keeps that many effects playing,
+// alternating tones and icons panned from side to side, and times
+// mix_effects alone over RENDER_SECONDS of output.
+void bench_mix(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    if (start_bench_queues() != 0) {
+        return;
+    }
+    fill_bench_speech();
+    output_rate = BENCH_MIX_RATE;
+    resampler_init(output_rate);
+    static float speech[FRAMES_PER_BUFFER * OUTPUT_CHANNELS];
+    static float out[FRAMES_PER_BUFFER * OUTPUT_CHANNELS];
+    keep_speech_queued();
+    render_audio(speech, FRAMES_PER_BUFFER);
+
+    // Every effect outlasts the configuration, so none retires early
+    sf_count_t effect_frames = (sf_count_t)output_rate * (RENDER_SECONDS + 1);
+    int16_t *icon = malloc((size_t)effect_frames * sizeof(int16_t));
+    if (!icon) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (sf_count_t i = 0; i < effect_frames; i++) {
+        icon[i] = (int16_t)(8000.0 * sin(2.0 * RESAMPLE_PI * 660.0 * (double)i / output_rate));
+    }
+    float step = 2.0f * (float)RESAMPLE_PI * 880.0f / (float)output_rate;
+
+    printf("%-8s %-8s %22s %16s\n", "sources", "effects", "ms CPU per s of audio", "per source");
+    for (int effects = 0; effects <= MAX_MIX_VOICES; effects++) {
+        unsigned int generation = atomic_load(&playback_generation);
+        for (int e = 0; e < effects; e++) {
+            float pan = effects > 1 ? (float)e / (float)(effects - 1) : 0.5f;
+            audio_item_t item = {
+                .source = e % 2 == 0 ? SOURCE_TONE : SOURCE_PCM,
+                .data = e % 2 == 0 ? NULL : icon,
+                .frames = effect_frames,
+                .gain = { 1.0f - pan, pan },
+                .generation = generation,
+                .sound_frame = -1,
+                .resident = 1,
+                .tone_step = { cosf(step), sinf(step) }
+            };
+            if (audio_ring_push(&effect_ring, &item) != 0) {
+                fprintf(stderr, "Effect ring full\n");
+                exit(1);
+            }
+        }
+        uint64_t total_ns = 0;
+        uint64_t frames = (uint64_t)output_rate * RENDER_SECONDS;
+        for (uint64_t done = 0; done < frames; done += FRAMES_PER_BUFFER) {
+            memcpy(out, speech, sizeof(out));
+            uint64_t start = uv_hrtime();
+            mix_effects(out, FRAMES_PER_BUFFER, FRAMES_PER_BUFFER);
+            total_ns += uv_hrtime() - start;
+        }
+        double ms = (double)total_ns / 1e6 / RENDER_SECONDS;
+        printf("%-8d %-8d %22.3f %16.3f\n", effects + 1, effects, ms, ms / (effects + 1));
+
+        // A stop retires the voices before the next configuration
+        atomic_fetch_add(&playback_generation, 1);
+        mix_effects(out, FRAMES_PER_BUFFER, FRAMES_PER_BUFFER);
+        reclaim_audio_items();
+    }
+    free(icon);
+    free(resampler.coeffs);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(int argc, char **argv);  // Arguments after the benchmark's name
+} bench_t;
+
+static const bench_t benches[] = {
+    { "parse", bench_parse },
+    { "lines", bench_lines },
+    { "engines", bench_engines },
+    { "resample", bench_resample },
+    { "memory", bench_memory },
+    { "mix", bench_mix },
+};
+
+int main(int argc, char **argv) {
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s BENCHMARK [ARGS]\nBenchmarks:", argv[0]);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(stderr, " %s", benches[i].name);
+        }
+        fputc('\n', stderr);
+        return 2;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(argv[1], benches[i].name) == 0) {
+            printf("%s:\n", benches[i].name);
+            benches[i].run(argc - 2, argv + 2);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+    return 2;
+}
@@ -1,3 +1,8 @@
+// ftruncate, mmap, flock and mkstemp are not part of C11; ask for them
+// before any system header is read
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <uv.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,341 +10,4075 @@
 #include <dtk/ttsapi.h>
 #include <sndfile.h>
 #include <portaudio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <ctype.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OMNIVOX_SSE2 1
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define OMNIVOX_AVX2 1
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define OMNIVOX_NEON 1
+#endif
 
 #define DEFAULT_PORT 22222
 #define DEFAULT_BACKLOG 128
-#define MAX_LINE_LENGTH 1024
-#define MAX_AUDIO_QUEUE 5
+#define DEFAULT_MAX_LINE_LENGTH (1024 * 1024)
+#define READ_BUFFER_SIZE (64 * 1024)
+#define LINE_BUFFER_KEEP (64 * 1024)  // Larger buffers are freed once their line is done
+#define DEFAULT_CHUNK_FRAMES 1024
+#define MIN_CHUNK_FRAMES 64  // About 6 ms; smaller chunks cost more in callbacks than they save
+#define DEFAULT_SPEECH_RATE 225
+#define MAX_BATCH_LENGTH (64 * 1024)
+#define REQUEST_TEXT_BLOCK 512  // Pooled text per request; longer text is malloc'd
+#define DECTALK_SAMPLE_RATE 11025  // WAVE_FORMAT_1M16
+#define STREAM_BUFFER_COUNT 4
+#define DEFAULT_AUDIO_BUDGET_MS 30000
+#define DEFAULT_TEXT_BUDGET (256 * 1024)
+#define RESUME_CHECK_INTERVAL_MS 10
+#define PUBLISH_WAIT_MS 5  // Longest a full queue waits between checks; reclaims and stops wake it sooner
+#define OUTPUT_CHANNELS 2
+#define SPEECH_GAIN_LEFT 0.0f  // Speech plays on the right channel only
+#define SPEECH_GAIN_RIGHT 1.0f
+#define FRAMES_PER_BUFFER 256
+#define DEFAULT_WAV_FILE "omnivox_output.wav"
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (48 * HISTOGRAM_SUB_BUCKETS)
+#define SILENCE_THRESHOLD 3  // 16-bit sample magnitude, about -80 dBFS
+#define DEFAULT_CACHE_MB 16
+#define CACHE_MAX_TEXT 256
+#define CACHE_TABLE_SIZE 1024  // Must be a power of two
+#define DEFAULT_PHRASE_CACHE_MB 64
+#define DEFAULT_DICTIONARY "dic/dtalk_us.dic"
+#define PHRASE_CACHE_MAGIC "OVXPHRS1"
+#define PHRASE_CACHE_FORMAT 2
+#define PHRASE_PAGE_SIZE 4096
+#define PHRASE_SLOTS 4096  // Must be a power of two
+#define DEFAULT_ENGINES 1
+#define MAX_ENGINES 8
+#define DEFAULT_SPLIT_CHARS 400
+#define CARRY_SETTING_LENGTH 64  // A longer setting is not repeated on later chunks
+#define INLINE_VOICE_UNKNOWN UINT64_MAX  // Inline settings carry_t could not keep track of
+#define MAX_RESAMPLE_TAPS 32
+#define MAX_RESAMPLE_PHASES 4096
+#define RESAMPLE_BLOCK_FRAMES 64
+#define RESAMPLE_PI 3.14159265358979323846
+#define MAX_MIX_VOICES 8  // Effects playing at once, on top of speech
+#define EFFECT_RING_SIZE 64
+#define MIX_CHUNK_FRAMES 256
+#define LIMITER_KNEE 0.8f  // Mixed samples above this are compressed towards full scale
+#define ICON_TABLE_SIZE 256  // Must be a power of two
+#define ICON_MAX_SECONDS 60
+#define ICON_GAIN 1.0f
+#define TONE_GAIN 0.5f
+#define TONE_RAMP_DIVISOR 200  // 5 ms fade in and out so tones don't click
+#define MAX_TONE_FREQUENCY 20000  // Also held below Nyquist at the output rate
+#define LETTER_ENGINE MAX_ENGINES  // engines[] slot of the letter bank's DECtalk
+#define LETTER_TEXT_MAX (64 + 2 * (CARRY_SETTING_LENGTH + 3))  // The letter, then the voice to restore
+#define LETTER_CAP_PITCH 160  // Average pitch for capitals when the voice marks them
 
+// Holds only a line that spans reads; complete lines are parsed in place.
 typedef struct {
-    uv_tcp_t handle;
-    char buffer[MAX_LINE_LENGTH];
-    size_t buffer_len;
+    char *data;
+    size_t len;
+    size_t capacity;
+    int discarding;  // Skipping the rest of an oversized line
+} line_buffer_t;
+
+// stdin and TCP connections are both clients so backpressure can pause
+// every reader the same way.
+typedef struct client_s {
+    union {
+        uv_stream_t stream;
+        uv_tcp_t tcp;
+        uv_pipe_t pipe;
+    } handle;
+    char *read_buffer;  // Reused by every read on this client
+    line_buffer_t lines;
+    struct client_s *prev;
+    struct client_s *next;
 } client_t;
 
+enum {
+    PUNCT_NONE,
+    PUNCT_SOME,
+    PUNCT_ALL
+};
+
+// Speech settings as the Emacspeak client last set them. Each synthesis
+// request carries a snapshot so settings apply in command order.
+typedef struct {
+    int rate;
+    int punctuation;
+    int capitalize;
+    int allcaps_beep;
+    int split_caps;
+    uint64_t inline_voice;  // Hash of the [: ] voice settings speech left in force, 0 if none
+} voice_state_t;
+
+typedef struct cache_entry_s {
+    uint64_t hash;
+    char *text;
+    voice_state_t voice;
+    int16_t *data;
+    sf_count_t frames;
+    size_t bytes;
+    atomic_int refs;  // The cache's own reference plus one per queued item
+    struct cache_entry_s *hash_next;
+    struct cache_entry_s *lru_prev;
+    struct cache_entry_s *lru_next;
+} cache_entry_t;
+
+enum {
+    SOURCE_PCM,      // data holds frames of mono 16-bit PCM
+    SOURCE_SILENCE,  // A pause in the speech queue; no data
+    SOURCE_TONE      // A sine generated while mixing; no data
+};
+
+// Queued audio stays mono 16-bit, speech at DECtalk's rate and effects at
+// output_rate; rendering converts and places it in the stereo field with
+// the item's gains. Pauses and tones are generated during playback and
+// carry only a descriptor.
 typedef struct {
-    float *data;
+    int source;
+    int16_t *data;
     sf_count_t frames;
-    int samplerate;
-    int channels;
-    int is_processed;
-    int is_playing;
+    float gain[OUTPUT_CHANNELS];
+    unsigned int generation;
+    uint64_t received_at;     // When the request's line was read
+    sf_count_t sound_frame;   // First non-silent frame of the request, or -1
+    cache_entry_t *owner;     // Cached audio the item borrows, or NULL if it owns data
+    int resident;             // Data belongs to the icon bank and is never freed
+    float tone_step[2];       // Cosine and sine of a tone's phase step per frame
 } audio_item_t;
 
+// Wait-free single-producer/single-consumer ring of item descriptors.
+// head is only written by the consumer, tail only by the producer. The
+// capacity is a power of two sized from the audio budget at startup.
+typedef struct {
+    audio_item_t *items;
+    size_t capacity;
+    atomic_size_t head;
+    atomic_size_t tail;
+} audio_ring_t;
+
+// An effect the mixer is playing, and how far it has got
+typedef struct {
+    audio_item_t item;
+    sf_count_t frame;
+    float oscillator[2];  // A tone's current phase as a unit vector
+    int active;
+} mix_voice_t;
+
+typedef struct {
+    char *text;
+    voice_state_t voice;
+    unsigned int generation;
+    uint64_t received_at;
+    uint64_t enqueued_at;
+    sf_count_t silence_frames;  // A pause (sh) rather than speech when text is NULL
+    int letter;                 // The character an l speaks, or 0
+} synth_request_t;
+
+// Pipeline stages timed per request, from the read in on_read through to
+// the first audible sample leaving render_audio.
+enum {
+    STAGE_PARSE,         // line read -> request queued
+    STAGE_QUEUE_WAIT,    // request queued -> worker picks it up
+    STAGE_FIRST_CHUNK,   // synthesis start -> first audio published
+    STAGE_SYNTH,         // synthesis start -> DECtalk done
+    STAGE_COPY,          // copying PCM into a pool block, per item
+    STAGE_PUBLISH,       // waiting for and pushing into audio_ring, per item
+    STAGE_FIRST_SAMPLE,  // line read -> first non-silent sample rendered
+    STAGE_COUNT
+};
+
+// Log-linear histogram in microseconds: 16 sub-buckets per power of two,
+// so any percentile is reported within about 6%.
+typedef struct {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong total;
+} latency_histogram_t;
+
+// Text accumulated from q/c commands until the next d
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    unsigned long fragments;
+} speech_batch_t;
+
+// Counters are written from several threads and read when reporting
+typedef struct {
+    atomic_ulong batches_dispatched;
+    atomic_ulong fragments_batched;
+    atomic_ulong dectalk_calls_saved;
+    atomic_ulong stops;
+    atomic_uint_fast64_t stop_latency_last_ns;
+    atomic_uint_fast64_t stop_latency_max_ns;
+    atomic_size_t audio_items_high_water;
+    atomic_llong audio_frames_high_water;
+    atomic_size_t text_bytes_high_water;
+    atomic_ulong read_pauses;
+    atomic_ulong reads;
+    atomic_ulong read_buffer_allocations;
+    atomic_ulong bytes_read;
+    atomic_ulong bytes_assembled;
+    atomic_ulong lines_rejected;
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    atomic_ulong cache_insertions;
+    atomic_ulong cache_evictions;
+    atomic_ulong phrase_hits;
+    atomic_ulong phrase_misses;
+    atomic_ulong phrase_stores;
+    atomic_ulong phrase_evictions;
+    atomic_ulong utterances_split;
+    atomic_ulong chunks_queued;
+    atomic_ulong reorder_holds;
+    atomic_uint_fast64_t reorder_wait_ns;
+    atomic_ulong effects_queued;
+    atomic_ulong effects_dropped;
+    atomic_ulong icons_loaded;
+    atomic_ulong icons_played;
+    atomic_ulong icons_failed;
+    atomic_ulong tones_played;
+    atomic_ulong pauses_queued;
+    atomic_llong pause_frames;
+    atomic_ulong letter_hits;
+    atomic_ulong letter_misses;
+    atomic_ulong letters_rendered;
+    atomic_uint_fast64_t letter_render_ns;
+    // Indexed by how many sources were mixed into the buffer
+    atomic_uint_fast64_t mix_ns[MAX_MIX_VOICES + 2];
+    atomic_ulong mix_frames[MAX_MIX_VOICES + 2];
+} metrics_t;
+
+typedef struct {
+    int16_t *data;
+    sf_count_t frames;
+    sf_count_t capacity;
+    int active;
+} capture_buffer_t;
+
+// One DECtalk instance and the thread that drives it. The request fields
+// are set by that thread before it speaks and read by publish_audio_item,
+// which may run on DECtalk's callback thread for the handle.
 typedef struct {
-    BYTE *buffer;
-    DWORD buffer_size;
-    DWORD current_position;
-} virtual_file_t;
+    int index;
+    char name[32];
+    LPTTS_HANDLE_T handle;
+    uv_thread_t thread;
+    voice_state_t applied_voice;
+    TTS_BUFFER_T stream_buffers[STREAM_BUFFER_COUNT];
+    atomic_int stream_active;
+    atomic_int busy;  // Set from taking a request until it is finished
+    capture_buffer_t capture;
+    int render_only;  // Captures audio for the letter bank and queues none
 
-LPTTS_HANDLE_T tts_handle;
+    uint64_t ticket;
+    unsigned int generation;
+    uint64_t received_at;
+    uint64_t started_at;
+    atomic_int first_chunk_pending;
+    atomic_int sound_pending;
+
+    // Audio that is ready before every earlier ticket has been published
+    audio_item_t *held;
+    size_t held_count;
+    size_t held_capacity;
+
+    atomic_ulong utterances;
+    atomic_uint_fast64_t busy_ns;
+} engine_t;
+
+engine_t engines[MAX_ENGINES + 1];  // The last slot is the letter bank's
+int engine_count = DEFAULT_ENGINES;
 uv_loop_t *loop;
-uv_mutex_t audio_queue_mutex;
-uv_cond_t audio_queue_cond;
-audio_item_t audio_queue[MAX_AUDIO_QUEUE];
-int audio_queue_size = 0;
-int current_audio_index = 0;
+// audio_ring carries finished items from the synthesis worker to
+// audio_callback; reclaim_ring hands played items back so their buffers
+// are freed off the real-time thread.
+audio_ring_t audio_ring;
+audio_ring_t reclaim_ring;
 PaStream *audio_stream;
 
+// Effects (auditory icons, tones) bypass the speech queue and are mixed
+// over it. The loop thread is effect_ring's only producer; mix_voices
+// belongs to the audio thread.
+audio_ring_t effect_ring;
+mix_voice_t mix_voices[MAX_MIX_VOICES];
+
+// Where rendered audio goes. PortAudio pulls from its own callback; the
+// null and WAV sinks run render_audio on a thread of their own, either
+// paced to real time or as fast as synthesis allows.
+typedef struct {
+    const char *name;
+    int (*start)(void);
+    void (*stop)(void);
+} audio_sink_t;
+
+uv_thread_t sink_thread;
+atomic_int sink_running = 0;
+int sink_realtime = 1;
+const char *wav_file_path = DEFAULT_WAV_FILE;
+SNDFILE *wav_file = NULL;
+
+// Synthesis workers: on_read/stdin_read only enqueue text, and each engine
+// thread takes the next request and runs the blocking DECtalk calls.
+uv_mutex_t synth_queue_mutex;
+uv_cond_t synth_queue_cond;
+synth_request_t *synth_queue = NULL;
+size_t synth_queue_capacity = 0;
+size_t synth_queue_head = 0;
+size_t synth_queue_size = 0;
+atomic_int synth_running = 0;
+
+// Reorder stage: requests take consecutive tickets as they leave the queue
+// and engines publish audio strictly in ticket order, holding back
+// whatever is ready early.
+uint64_t next_ticket = 0;     // Guarded by synth_queue_mutex
+uint64_t publish_ticket = 0;  // Guarded by reorder_mutex
+uv_mutex_t reorder_mutex;
+uv_cond_t reorder_cond;
+
+uv_mutex_t cache_mutex;
+uv_mutex_t reclaim_mutex;
+uint64_t engines_started_at = 0;
+
+// Queue budgets. Instead of dropping speech when they are exceeded, the
+// worker waits for playback and the loop stops reading from clients until
+// the backlog drains below half the budget.
+unsigned long audio_budget_ms = DEFAULT_AUDIO_BUDGET_MS;
+size_t text_budget = DEFAULT_TEXT_BUDGET;
+atomic_llong queued_audio_frames = 0;
+atomic_size_t queued_text_bytes = 0;
+client_t *clients = NULL;
+int reading_paused = 0;
+uv_timer_t resume_timer;
+size_t max_line_length = DEFAULT_MAX_LINE_LENGTH;
+int server_port = DEFAULT_PORT;
+
+// current_voice is owned by the loop thread; each engine tracks what it has applied
+voice_state_t current_voice = { DEFAULT_SPEECH_RATE, PUNCT_SOME, 0, 0, 0, 0 };
+char *dectalk_version = "unknown";
+
+speech_batch_t pending_speech;
+metrics_t metrics;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "parse", "queue wait", "first chunk", "synthesis", "copy", "publish", "first sample"
+};
+latency_histogram_t stage_latency[STAGE_COUNT];
+uint64_t line_received_at = 0;
+
+size_t cache_budget = (size_t)DEFAULT_CACHE_MB * 1024 * 1024;
+size_t cache_bytes = 0;
+cache_entry_t *cache_table[CACHE_TABLE_SIZE];
+cache_entry_t *cache_lru_head = NULL;
+cache_entry_t *cache_lru_tail = NULL;
+
+const char *phrase_cache_path = NULL;
+size_t phrase_cache_size = (size_t)DEFAULT_PHRASE_CACHE_MB * 1024 * 1024;
+const char *dictionary_path = DEFAULT_DICTIONARY;
+
+// Stop (s) bumps playback_generation. Requests and audio items are stamped
+// with the generation they were queued under, and anything older is
+// dropped by the engines, by publish_audio_item and by audio_callback.
+atomic_uint playback_generation = 0;
+atomic_uint_fast64_t stop_requested_at = 0;
+
+// Streaming synthesis: DECtalk fills each engine's fixed-size
+// stream_buffers and hands each one to tts_callback as soon as it is full,
+// so playback can start after the first chunk instead of after the whole
+// utterance.
+int streaming_enabled = 1;
+unsigned long stream_chunk_frames = DEFAULT_CHUNK_FRAMES;
+size_t split_chars = DEFAULT_SPLIT_CHARS;  // 0 disables sentence chunking
+uv_mutex_t publish_mutex;
+uv_cond_t publish_cond;  // A full queue may have room, or the wait should end
+
+// Hot-path tracing. Each thread appends fixed-size binary events to its
+// own single-producer ring; a background thread drains the rings and
+// writes Chrome trace JSON (load it in chrome://tracing or Perfetto).
+// Events above OMNIVOX_TRACE_LEVEL compile to nothing, and when --trace is
+// not given an enabled-check is all a trace point costs. A full ring drops
+// events rather than blocking the thread that emits them.
+#ifndef OMNIVOX_TRACE_LEVEL
+#define OMNIVOX_TRACE_LEVEL 1  // 0: off, 1: per utterance, 2: per buffer
+#endif
+#define TRACE_RING_SIZE 4096  // Must be a power of two
+#define MAX_TRACE_THREADS 32
+#define TRACE_FLUSH_INTERVAL_MS 100
+
+typedef struct {
+    uint64_t timestamp;
+    const char *name;  // Must be a string literal
+    int64_t value;
+    char phase;        // Chrome trace phase: B, E, i or C
+} trace_event_t;
+
+typedef struct {
+    trace_event_t events[TRACE_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_ulong dropped;
+    const char *thread_name;
+    atomic_int ready;  // Set once thread_name is written
+    int named;         // Thread name metadata written; flush thread only
+} trace_ring_t;
+
+trace_ring_t trace_rings[MAX_TRACE_THREADS];
+atomic_int trace_ring_count = 0;
+atomic_int trace_enabled = 0;
+_Thread_local trace_ring_t *thread_trace_ring = NULL;
+_Thread_local int thread_trace_claimed = 0;  // Registration tried, ring or not
+FILE *trace_file = NULL;
+const char *trace_file_path = NULL;
+uv_thread_t trace_thread;
+int trace_events_written = 0;
+
+// Claims a ring for the calling thread; lock-free so the audio and DECtalk
+// threads can register lazily on their first event. A thread tries once,
+// so one that finds every ring taken does not keep claiming slots, and
+// the flush thread skips a ring until its name is published.
+trace_ring_t *trace_register_thread(const char *name) {
+    if (thread_trace_claimed) {
+        return thread_trace_ring;
+    }
+    thread_trace_claimed = 1;
+    int slot = atomic_fetch_add(&trace_ring_count, 1);
+    if (slot >= MAX_TRACE_THREADS) {
+        return NULL;
+    }
+    trace_rings[slot].thread_name = name ? name : "thread";
+    atomic_store_explicit(&trace_rings[slot].ready, 1, memory_order_release);
+    thread_trace_ring = &trace_rings[slot];
+    return thread_trace_ring;
+}
+
+void trace_emit(char phase, const char *name, int64_t value) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_ring_t *ring = thread_trace_claimed ? thread_trace_ring : trace_register_thread(NULL);
+    if (!ring) {
+        return;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    trace_event_t *event = &ring->events[tail & (TRACE_RING_SIZE - 1)];
+    event->timestamp = uv_hrtime();
+    event->name = name;
+    event->value = value;
+    event->phase = phase;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+#if OMNIVOX_TRACE_LEVEL > 0
+#define TRACE_BEGIN(level, name, value) do { if ((level) <= OMNIVOX_TRACE_LEVEL) trace_emit('B', name, (int64_t)(value)); } while (0)
+#define TRACE_END(level, name) do { if ((level) <= OMNIVOX_TRACE_LEVEL) trace_emit('E', name, 0); } while (0)
+#define TRACE_INSTANT(level, name, value) do { if ((level) <= OMNIVOX_TRACE_LEVEL) trace_emit('i', name, (int64_t)(value)); } while (0)
+#define TRACE_COUNTER(level, name, value) do { if ((level) <= OMNIVOX_TRACE_LEVEL) trace_emit('C', name, (int64_t)(value)); } while (0)
+#else
+#define TRACE_BEGIN(level, name, value) do { } while (0)
+#define TRACE_END(level, name) do { } while (0)
+#define TRACE_INSTANT(level, name, value) do { } while (0)
+#define TRACE_COUNTER(level, name, value) do { } while (0)
+#endif
+
+void trace_write_event(int tid, const trace_event_t *event) {
+    fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+            trace_events_written++ ? "," : "", event->name, event->phase,
+            (double)event->timestamp / 1000.0, tid);
+    if (event->phase == 'i') {
+        fprintf(trace_file, ",\"s\":\"t\"");
+    }
+    if (event->phase != 'E') {
+        fprintf(trace_file, ",\"args\":{\"value\":%lld}", (long long)event->value);
+    }
+    fputc('}', trace_file);
+}
+
+void trace_flush(void) {
+    int count = atomic_load(&trace_ring_count);
+    if (count > MAX_TRACE_THREADS) {
+        count = MAX_TRACE_THREADS;
+    }
+    for (int tid = 0; tid < count; tid++) {
+        trace_ring_t *ring = &trace_rings[tid];
+        if (!atomic_load_explicit(&ring->ready, memory_order_acquire)) {
+            continue;
+        }
+        if (!ring->named) {
+            fprintf(trace_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    trace_events_written++ ? "," : "", tid, ring->thread_name);
+            ring->named = 1;
+        }
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            trace_write_event(tid, &ring->events[head & (TRACE_RING_SIZE - 1)]);
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    fflush(trace_file);
+}
+
+void trace_thread_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&trace_enabled)) {
+        uv_sleep(TRACE_FLUSH_INTERVAL_MS);
+        trace_flush();
+    }
+}
+
+int start_tracing(void) {
+    if (!trace_file_path) {
+        return 0;
+    }
+    trace_file = fopen(trace_file_path, "w");
+    if (!trace_file) {
+        fprintf(stderr, "Error opening trace file %s\n", trace_file_path);
+        return -1;
+    }
+    fputc('[', trace_file);
+    atomic_store(&trace_enabled, 1);
+    int r = uv_thread_create(&trace_thread, trace_thread_main, NULL);
+    if (r) {
+        fprintf(stderr, "Trace thread error %s\n", uv_strerror(r));
+        atomic_store(&trace_enabled, 0);
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void stop_tracing(void) {
+    if (!trace_file) {
+        return;
+    }
+    atomic_store(&trace_enabled, 0);
+    uv_thread_join(&trace_thread);
+    trace_flush();
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+
+    unsigned long dropped = 0;
+    for (int i = 0; i < MAX_TRACE_THREADS; i++) {
+        dropped += atomic_load(&trace_rings[i].dropped);
+    }
+    if (dropped) {
+        fprintf(stderr, "Trace events dropped: %lu\n", dropped);
+    }
+}
+
+// Every client reads into one buffer allocated on its first read. on_read
+// parses each read completely before returning, so the buffer is free
+// again by the time libuv asks for the next one.
 void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-    (void)handle;
-    buf->base = malloc(suggested_size);
-    buf->len = suggested_size;
+    (void)suggested_size;
+    client_t *c = (client_t *)handle->data;
+    if (!c->read_buffer) {
+        c->read_buffer = malloc(READ_BUFFER_SIZE);
+        atomic_fetch_add(&metrics.read_buffer_allocations, 1);
+    }
+    buf->base = c->read_buffer;
+    buf->len = c->read_buffer ? READ_BUFFER_SIZE : 0;
+}
+
+// Converts mono int16 PCM to interleaved stereo float, scaling each
+// channel by its gain. Runs on the audio thread for every queued item.
+// Each path handles whole vectors and leaves the remainder to the scalar
+// loop.
+static void pcm16_pan_scalar(const int16_t *in, float *out, size_t start, size_t frames, const float *gain) {
+    float left = gain[0] * (1.0f / 32768.0f);
+    float right = gain[1] * (1.0f / 32768.0f);
+    for (size_t i = start; i < frames; i++) {
+        out[i*2] = (float)in[i] * left;
+        out[i*2+1] = (float)in[i] * right;
+    }
+}
+
+#ifdef OMNIVOX_AVX2
+__attribute__((target("avx2")))
+static size_t pcm16_pan_avx2(const int16_t *in, float *out, size_t frames, const float *gain) {
+    const __m256 left = _mm256_set1_ps(gain[0] * (1.0f / 32768.0f));
+    const __m256 right = _mm256_set1_ps(gain[1] * (1.0f / 32768.0f));
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(const void *)(in + i)));
+        __m256 s = _mm256_cvtepi32_ps(wide);
+        __m256 l = _mm256_mul_ps(s, left);
+        __m256 r = _mm256_mul_ps(s, right);
+        __m256 lo = _mm256_unpacklo_ps(l, r);  // l0 r0 l1 r1 | l4 r4 l5 r5
+        __m256 hi = _mm256_unpackhi_ps(l, r);  // l2 r2 l3 r3 | l6 r6 l7 r7
+        _mm256_storeu_ps(out + i*2, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(out + i*2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    return i;
 }
+#endif
 
-void process_wav_in_memory(float *input_data, sf_count_t input_frames, int input_samplerate, float **output_data, sf_count_t *output_frames) {
-    (void)input_samplerate;
-    printf("Processing WAV in memory\n");
+#ifdef OMNIVOX_SSE2
+static size_t pcm16_pan_sse2(const int16_t *in, float *out, size_t frames, const float *gain) {
+    const __m128 left = _mm_set1_ps(gain[0] * (1.0f / 32768.0f));
+    const __m128 right = _mm_set1_ps(gain[1] * (1.0f / 32768.0f));
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+        // Sign-extend by placing each sample in the high half, then shifting down
+        __m128 s0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        __m128 s1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        __m128 l0 = _mm_mul_ps(s0, left), r0 = _mm_mul_ps(s0, right);
+        __m128 l1 = _mm_mul_ps(s1, left), r1 = _mm_mul_ps(s1, right);
+        _mm_storeu_ps(out + i*2, _mm_unpacklo_ps(l0, r0));
+        _mm_storeu_ps(out + i*2 + 4, _mm_unpackhi_ps(l0, r0));
+        _mm_storeu_ps(out + i*2 + 8, _mm_unpacklo_ps(l1, r1));
+        _mm_storeu_ps(out + i*2 + 12, _mm_unpackhi_ps(l1, r1));
+    }
+    return i;
+}
+#endif
 
-    *output_frames = input_frames;
-    *output_data = malloc((size_t)(*output_frames) * 2 * sizeof(float));  // Allocate stereo output
+#ifdef OMNIVOX_NEON
+static size_t pcm16_pan_neon(const int16_t *in, float *out, size_t frames, const float *gain) {
+    const float left = gain[0] * (1.0f / 32768.0f);
+    const float right = gain[1] * (1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        int16x8_t v = vld1q_s16(in + i);
+        float32x4_t s0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t s1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        float32x4x2_t lo = { { vmulq_n_f32(s0, left), vmulq_n_f32(s0, right) } };
+        float32x4x2_t hi = { { vmulq_n_f32(s1, left), vmulq_n_f32(s1, right) } };
+        vst2q_f32(out + i*2, lo);
+        vst2q_f32(out + i*2 + 8, hi);
+    }
+    return i;
+}
+#endif
 
-    for (sf_count_t i = 0; i < input_frames; i++) {
-        (*output_data)[i*2] = 0;           // Left channel (silent)
-        (*output_data)[i*2+1] = input_data[i]; // Right channel
+#ifdef OMNIVOX_AVX2
+// Engines and the audio thread probe concurrently; the probe is idempotent
+static int cpu_has_avx2(void) {
+    static atomic_int has_avx2 = -1;
+    int avx2 = atomic_load_explicit(&has_avx2, memory_order_relaxed);
+    if (avx2 < 0) {
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        atomic_store_explicit(&has_avx2, avx2, memory_order_relaxed);
     }
+    return avx2;
+}
+#endif
 
-    printf("WAV processing complete. Total frames processed: %lld\n", (long long)*output_frames);
+void pcm16_pan(const int16_t *in, float *out, size_t frames, const float *gain) {
+    size_t done = 0;
+#if defined(OMNIVOX_AVX2)
+    done = cpu_has_avx2() ? pcm16_pan_avx2(in, out, frames, gain) : pcm16_pan_sse2(in, out, frames, gain);
+#elif defined(OMNIVOX_SSE2)
+    done = pcm16_pan_sse2(in, out, frames, gain);
+#elif defined(OMNIVOX_NEON)
+    done = pcm16_pan_neon(in, out, frames, gain);
+#endif
+    pcm16_pan_scalar(in, out, done, frames, gain);
 }
 
-int audio_callback(const void *inputBuffer, void *outputBuffer,
-                   unsigned long framesPerBuffer,
-                   const PaStreamCallbackTimeInfo* timeInfo,
-                   PaStreamCallbackFlags statusFlags,
-                   void *userData) {
-    (void)inputBuffer;
-    (void)timeInfo;
-    (void)statusFlags;
-    (void)userData;
+// Adds src into dst, both interleaved stereo float, count samples long
+static void mix_add_scalar(float *dst, const float *src, size_t start, size_t count) {
+    for (size_t i = start; i < count; i++) {
+        dst[i] += src[i];
+    }
+}
 
-    float *out = (float*)outputBuffer;
-    static sf_count_t current_frame = 0;
+// Soft limiter for mixed output: linear up to LIMITER_KNEE, then
+// compressed so the result approaches but never reaches full scale.
+static void soft_limit_scalar(float *buf, size_t start, size_t count) {
+    const float range = 1.0f - LIMITER_KNEE;
+    for (size_t i = start; i < count; i++) {
+        float magnitude = buf[i] < 0.0f ? -buf[i] : buf[i];
+        if (magnitude > LIMITER_KNEE) {
+            float over = magnitude - LIMITER_KNEE;
+            magnitude = LIMITER_KNEE + over / (1.0f + over / range);
+            buf[i] = buf[i] < 0.0f ? -magnitude : magnitude;
+        }
+    }
+}
+
+#ifdef OMNIVOX_AVX2
+__attribute__((target("avx2")))
+static size_t mix_add_avx2(float *dst, const float *src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t soft_limit_avx2(float *buf, size_t count) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 knee = _mm256_set1_ps(LIMITER_KNEE);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 slope = _mm256_set1_ps(1.0f / (1.0f - LIMITER_KNEE));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(buf + i);
+        __m256 magnitude = _mm256_andnot_ps(sign, x);
+        __m256 over = _mm256_max_ps(_mm256_sub_ps(magnitude, knee), zero);
+        __m256 limited = _mm256_add_ps(_mm256_min_ps(magnitude, knee),
+                                       _mm256_div_ps(over, _mm256_add_ps(one, _mm256_mul_ps(over, slope))));
+        _mm256_storeu_ps(buf + i, _mm256_or_ps(limited, _mm256_and_ps(sign, x)));
+    }
+    return i;
+}
+#endif
+
+#ifdef OMNIVOX_SSE2
+static size_t mix_add_sse2(float *dst, const float *src, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+    }
+    return i;
+}
+
+static size_t soft_limit_sse2(float *buf, size_t count) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 knee = _mm_set1_ps(LIMITER_KNEE);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 slope = _mm_set1_ps(1.0f / (1.0f - LIMITER_KNEE));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(buf + i);
+        __m128 magnitude = _mm_andnot_ps(sign, x);
+        __m128 over = _mm_max_ps(_mm_sub_ps(magnitude, knee), zero);
+        __m128 limited = _mm_add_ps(_mm_min_ps(magnitude, knee),
+                                    _mm_div_ps(over, _mm_add_ps(one, _mm_mul_ps(over, slope))));
+        _mm_storeu_ps(buf + i, _mm_or_ps(limited, _mm_and_ps(sign, x)));
+    }
+    return i;
+}
+#endif
 
-    uv_mutex_lock(&audio_queue_mutex);
-    if (audio_queue_size > 0 && !audio_queue[current_audio_index].is_playing && audio_queue[current_audio_index].is_processed) {
-        audio_queue[current_audio_index].is_playing = 1;
-        current_frame = 0;
+#ifdef OMNIVOX_NEON
+static size_t mix_add_neon(float *dst, const float *src, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
     }
-    uv_mutex_unlock(&audio_queue_mutex);
+    return i;
+}
+
+static size_t soft_limit_neon(float *buf, size_t count) {
+    const float32x4_t knee = vdupq_n_f32(LIMITER_KNEE);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t x = vld1q_f32(buf + i);
+        float32x4_t magnitude = vabsq_f32(x);
+        float32x4_t over = vmaxq_f32(vsubq_f32(magnitude, knee), zero);
+        float32x4_t denominator = vmlaq_n_f32(one, over, 1.0f / (1.0f - LIMITER_KNEE));
+        // Reciprocal estimate refined twice is exact to float precision
+        float32x4_t reciprocal = vrecpeq_f32(denominator);
+        reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+        reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+        float32x4_t limited = vaddq_f32(vminq_f32(magnitude, knee), vmulq_f32(over, reciprocal));
+        vst1q_f32(buf + i, vbslq_f32(vcltq_f32(x, zero), vnegq_f32(limited), limited));
+    }
+    return i;
+}
+#endif
+
+void mix_add(float *dst, const float *src, size_t count) {
+    size_t done = 0;
+#if defined(OMNIVOX_AVX2)
+    done = cpu_has_avx2() ? mix_add_avx2(dst, src, count) : mix_add_sse2(dst, src, count);
+#elif defined(OMNIVOX_SSE2)
+    done = mix_add_sse2(dst, src, count);
+#elif defined(OMNIVOX_NEON)
+    done = mix_add_neon(dst, src, count);
+#endif
+    mix_add_scalar(dst, src, done, count);
+}
+
+void soft_limit(float *buf, size_t count) {
+    size_t done = 0;
+#if defined(OMNIVOX_AVX2)
+    done = cpu_has_avx2() ? soft_limit_avx2(buf, count) : soft_limit_sse2(buf, count);
+#elif defined(OMNIVOX_SSE2)
+    done = soft_limit_sse2(buf, count);
+#elif defined(OMNIVOX_NEON)
+    done = soft_limit_neon(buf, count);
+#endif
+    soft_limit_scalar(buf, done, count);
+}
+
+int audio_ring_init(audio_ring_t *ring, size_t min_capacity) {
+    size_t capacity = 16;
+    while (capacity < min_capacity) {
+        capacity *= 2;
+    }
+    ring->items = calloc(capacity, sizeof(audio_item_t));
+    if (!ring->items) {
+        return -1;
+    }
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+int audio_ring_push(audio_ring_t *ring, const audio_item_t *item) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ring->capacity) {
+        return -1;
+    }
+    ring->items[tail & (ring->capacity - 1)] = *item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int audio_ring_pop(audio_ring_t *ring, audio_item_t *item) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return -1;
+    }
+    *item = ring->items[head & (ring->capacity - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+size_t audio_ring_depth(audio_ring_t *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail - head;
+}
+
+int audio_ring_full(audio_ring_t *ring) {
+    return audio_ring_depth(ring) == ring->capacity;
+}
+
+size_t histogram_bucket(uint64_t us) {
+    if (us < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t)us;
+    }
+    unsigned msb = 0;
+    for (uint64_t v = us; v > 1; v >>= 1) {
+        msb++;
+    }
+    size_t bucket = (size_t)(msb - 3) * HISTOGRAM_SUB_BUCKETS + (size_t)((us >> (msb - 4)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t histogram_bucket_floor(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned msb = (unsigned)(bucket / HISTOGRAM_SUB_BUCKETS) + 3;
+    return ((uint64_t)HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (msb - 4);
+}
+
+// Lock-free and allocation-free, so it is safe on the audio thread
+void record_latency(int stage, uint64_t ns) {
+    latency_histogram_t *h = &stage_latency[stage];
+    atomic_fetch_add_explicit(&h->counts[histogram_bucket(ns / 1000)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+}
+
+uint64_t latency_percentile_us(int stage, double percentile) {
+    latency_histogram_t *h = &stage_latency[stage];
+    unsigned long total = atomic_load(&h->total);
+    unsigned long rank = (unsigned long)((double)total * percentile);
+    unsigned long seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen > rank) {
+            return histogram_bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+// First sample above the silence threshold, or -1
+sf_count_t first_sound_frame(const int16_t *data, sf_count_t frames) {
+    for (sf_count_t i = 0; i < frames; i++) {
+        if (data[i] > SILENCE_THRESHOLD || data[i] < -SILENCE_THRESHOLD) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+long long audio_budget_frames(void) {
+    return (long long)audio_budget_ms * DECTALK_SAMPLE_RATE / 1000;
+}
+
+void update_high_water(atomic_size_t *mark, size_t value) {
+    size_t seen = atomic_load(mark);
+    while (value > seen && !atomic_compare_exchange_weak(mark, &seen, value)) {
+    }
+}
+
+unsigned int output_rate = 0;  // 0: the device's native rate, or DECtalk's for the thread sinks
+
+// Plays queued speech into one buffer of DECtalk-rate frames and returns
+// how many came from the queue. Runs on the real-time audio thread: only
+// ring operations and sample conversion, no locks, no stdio and no
+// allocator calls.
+static sf_count_t render_speech(float *out, unsigned long framesPerBuffer) {
+    static audio_item_t current_item;
+    static int have_item = 0;
+    static sf_count_t current_frame = 0;
+    static unsigned int seen_generation = 0;
+    sf_count_t frames_written = 0;
+    unsigned int generation = atomic_load_explicit(&playback_generation, memory_order_acquire);
+    int cut = 0;
+
+    // Keep filling from successive items so back-to-back items play gaplessly
+    while (frames_written < (sf_count_t)framesPerBuffer) {
+        if (!have_item) {
+            if (audio_ring_pop(&audio_ring, &current_item) != 0) {
+                break;
+            }
+            have_item = 1;
+            current_frame = 0;
+            TRACE_INSTANT(1, "play item", current_item.frames);
+        }
+
+        // Items queued before the last stop are retired without playing
+        if (current_item.generation != generation) {
+            if (audio_ring_push(&reclaim_ring, &current_item) != 0) {
+                break;
+            }
+            atomic_fetch_sub_explicit(&queued_audio_frames, current_item.frames - current_frame, memory_order_relaxed);
+            have_item = 0;
+            cut = 1;
+            continue;
+        }
 
-    if (audio_queue_size > 0 && audio_queue[current_audio_index].is_playing) {
-        audio_item_t *current_item = &audio_queue[current_audio_index];
-        sf_count_t frames_to_play = (sf_count_t)framesPerBuffer;
-        if (current_frame + frames_to_play > current_item->frames) {
-            frames_to_play = current_item->frames - current_frame;
+        sf_count_t frames_to_play = (sf_count_t)framesPerBuffer - frames_written;
+        if (current_frame + frames_to_play > current_item.frames) {
+            frames_to_play = current_item.frames - current_frame;
         }
 
-        memcpy(out, current_item->data + current_frame * current_item->channels, (size_t)(frames_to_play * current_item->channels) * sizeof(float));
+        if (current_item.sound_frame >= current_frame && current_item.sound_frame < current_frame + frames_to_play) {
+            record_latency(STAGE_FIRST_SAMPLE, uv_hrtime() - current_item.received_at);
+        }
+        if (current_item.source == SOURCE_SILENCE) {
+            memset(out + frames_written * OUTPUT_CHANNELS, 0, (size_t)frames_to_play * OUTPUT_CHANNELS * sizeof(float));
+        } else {
+            pcm16_pan(current_item.data + current_frame, out + frames_written * OUTPUT_CHANNELS, (size_t)frames_to_play, current_item.gain);
+        }
         current_frame += frames_to_play;
+        frames_written += frames_to_play;
+        atomic_fetch_sub_explicit(&queued_audio_frames, frames_to_play, memory_order_relaxed);
 
-        // If we didn't read enough frames, fill the rest with silence
-        if (frames_to_play < (sf_count_t)framesPerBuffer) {
-            for (sf_count_t i = frames_to_play * current_item->channels; i < (sf_count_t)(framesPerBuffer * (unsigned long)current_item->channels); i++) {
-                out[i] = 0.0f;
+        if (current_frame < current_item.frames) {
+            continue;
+        }
+        // If the reclaim ring is full, the item is retried on the next buffer
+        if (audio_ring_push(&reclaim_ring, &current_item) != 0) {
+            break;
+        }
+        have_item = 0;
+    }
+
+    if (generation != seen_generation) {
+        seen_generation = generation;
+        if (cut) {
+            uint64_t latency = uv_hrtime() - atomic_load(&stop_requested_at);
+            atomic_store(&metrics.stop_latency_last_ns, latency);
+            if (latency > atomic_load(&metrics.stop_latency_max_ns)) {
+                atomic_store(&metrics.stop_latency_max_ns, latency);
             }
         }
+    }
+
+    TRACE_COUNTER(2, "frames rendered", frames_written);
+
+    // If we didn't read enough frames, fill the rest with silence
+    for (sf_count_t i = frames_written * 2; i < (sf_count_t)framesPerBuffer * 2; i++) {
+        out[i] = 0.0f;
+    }
+
+    return frames_written;
+}
+
+// Recursive quadrature oscillator: each frame rotates the phase vector by
+// the tone's step, two multiply-adds with no table and no libm. Linear
+// ramps at both ends keep the tone from clicking.
+static void render_tone(mix_voice_t *voice, float *out, sf_count_t start, sf_count_t frames) {
+    const audio_item_t *item = &voice->item;
+    float c = item->tone_step[0], s = item->tone_step[1];
+    float x = voice->oscillator[0], y = voice->oscillator[1];
+    sf_count_t ramp = (sf_count_t)(output_rate / TONE_RAMP_DIVISOR);
+    ramp = item->frames / 2 < ramp ? item->frames / 2 : ramp;
+    for (sf_count_t i = 0; i < frames; i++) {
+        sf_count_t position = start + i;
+        float sample = y;
+        if (position < ramp) {
+            sample *= (float)position / (float)ramp;
+        } else if (item->frames - position < ramp) {
+            sample *= (float)(item->frames - position) / (float)ramp;
+        }
+        out[i * OUTPUT_CHANNELS] = sample * item->gain[0];
+        out[i * OUTPUT_CHANNELS + 1] = sample * item->gain[1];
+        float rotated = x * c - y * s;
+        y = x * s + y * c;
+        x = rotated;
+    }
+    // One Newton step back onto the unit circle stops rounding drift
+    float correction = (3.0f - (x * x + y * y)) * 0.5f;
+    voice->oscillator[0] = x * correction;
+    voice->oscillator[1] = y * correction;
+}
 
-        printf("Frames played: %lld / %lld, Total played: %lld\n", 
-               (long long)frames_to_play, (long long)framesPerBuffer, (long long)current_frame);
+// Hands a finished or stopped effect back for freeing. If reclaim_ring is
+// full the voice stays put and is retried on the next buffer.
+static void retire_mix_voice(mix_voice_t *voice) {
+    voice->frame = voice->item.frames;
+    if (audio_ring_push(&reclaim_ring, &voice->item) == 0) {
+        voice->active = 0;
+    }
+}
 
-        if (current_frame >= current_item->frames) {
-            printf("End of audio reached\n");
+// Mixes active effects over the speech already in out. Speech alone is
+// left untouched; once sources overlap the sum goes through the soft
+// limiter. Returns how many leading frames carry audio.
+static sf_count_t mix_effects(float *out, unsigned long framesPerBuffer, sf_count_t speech_frames) {
+    static float scratch[MIX_CHUNK_FRAMES * OUTPUT_CHANNELS];
+    uint64_t start = uv_hrtime();
+    unsigned int generation = atomic_load_explicit(&playback_generation, memory_order_acquire);
+    int sources = speech_frames > 0;
+    sf_count_t covered = speech_frames;
 
-            uv_mutex_lock(&audio_queue_mutex);
-            free(current_item->data);
-            memmove(&audio_queue[0], &audio_queue[1], sizeof(audio_item_t) * (MAX_AUDIO_QUEUE - 1));
-            audio_queue_size--;
-            if (current_audio_index > 0) current_audio_index--;
-            uv_mutex_unlock(&audio_queue_mutex);
+    for (int v = 0; v < MAX_MIX_VOICES; v++) {
+        mix_voice_t *voice = &mix_voices[v];
+        if (!voice->active) {
+            if (audio_ring_pop(&effect_ring, &voice->item) != 0) {
+                continue;
+            }
+            voice->active = 1;
+            voice->frame = 0;
+            voice->oscillator[0] = 1.0f;
+            voice->oscillator[1] = 0.0f;
+            TRACE_INSTANT(1, "play effect", voice->item.frames);
+        }
+        if (voice->item.generation != generation || voice->frame >= voice->item.frames) {
+            retire_mix_voice(voice);
+            continue;
+        }
 
-            uv_cond_signal(&audio_queue_cond);
+        sf_count_t frames = voice->item.frames - voice->frame;
+        if (frames > (sf_count_t)framesPerBuffer) {
+            frames = (sf_count_t)framesPerBuffer;
         }
-    } else {
-        // No audio to play, output silence
-        for (unsigned long i = 0; i < framesPerBuffer * 2; i++) {
-            out[i] = 0.0f;
+        for (sf_count_t done = 0; done < frames; done += MIX_CHUNK_FRAMES) {
+            sf_count_t chunk = frames - done < MIX_CHUNK_FRAMES ? frames - done : MIX_CHUNK_FRAMES;
+            if (voice->item.source == SOURCE_TONE) {
+                render_tone(voice, scratch, voice->frame + done, chunk);
+            } else {
+                pcm16_pan(voice->item.data + voice->frame + done, scratch, (size_t)chunk, voice->item.gain);
+            }
+            mix_add(out + done * OUTPUT_CHANNELS, scratch, (size_t)chunk * OUTPUT_CHANNELS);
+        }
+        voice->frame += frames;
+        sources++;
+        if (frames > covered) {
+            covered = frames;
+        }
+        if (voice->frame == voice->item.frames) {
+            retire_mix_voice(voice);
+        }
+    }
+
+    if (sources > 1) {
+        soft_limit(out, (size_t)covered * OUTPUT_CHANNELS);
+    }
+    if (sources > 0) {
+        atomic_fetch_add_explicit(&metrics.mix_ns[sources], uv_hrtime() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&metrics.mix_frames[sources], framesPerBuffer, memory_order_relaxed);
+    }
+    return covered;
+}
+
+// Output rate conversion. Sinks run at output_rate; speech upstream,
+// including the queue budget and the caches, stays at DECtalk's rate.
+// Effects are mixed after conversion, at output_rate, so icons keep
+// their full bandwidth.
+// render_audio pulls source frames through a polyphase FIR: a Kaiser
+// windowed sinc prototype split into up phases of taps coefficients, with
+// output_rate / DECTALK_SAMPLE_RATE reduced to up / down. More taps give a
+// sharper low-pass at the cost of taps / 2 source frames of delay.
+typedef struct {
+    int active;
+    int taps;
+    unsigned int up;
+    unsigned int down;
+    float *coeffs;  // up phases of taps coefficients, oldest sample first
+    float history[OUTPUT_CHANNELS][2 * MAX_RESAMPLE_TAPS];  // Doubled so each window is contiguous
+    int history_pos;
+    unsigned int phase;
+    float block[RESAMPLE_BLOCK_FRAMES * OUTPUT_CHANNELS];
+    sf_count_t block_len;
+    sf_count_t block_pos;
+    int block_real;  // Whether the newest input came from the queue rather than silence
+    unsigned int generation;
+} resampler_t;
+
+resampler_t resampler;
+int resample_taps = 16;
+atomic_uint_fast64_t resample_ns = 0;
+atomic_uint_fast64_t resample_frames = 0;
+
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Reduces to / from to up / down, or returns -1 if that needs too many phases
+int resample_ratio(unsigned int from, unsigned int to, unsigned int *up, unsigned int *down) {
+    unsigned int divisor = gcd(from, to);
+    *up = to / divisor;
+    *down = from / divisor;
+    return *up > MAX_RESAMPLE_PHASES ? -1 : 0;
+}
+
+// Designs the polyphase filter for up / down: up phases of taps
+// coefficients each, stored oldest sample first. Returns NULL if out of memory.
+float *resample_filter(unsigned int up, unsigned int down, int taps) {
+    float *coeffs = malloc((size_t)up * (size_t)taps * sizeof(float));
+    if (!coeffs) {
+        return NULL;
+    }
+
+    // Longer filters can afford a passband closer to Nyquist and more stopband
+    double passband = taps >= 32 ? 0.97 : taps >= 16 ? 0.94 : 0.90;
+    double beta = taps >= 32 ? 10.0 : taps >= 16 ? 8.0 : 6.0;
+    double cutoff = 0.5 * passband / (double)(up > down ? up : down);
+    size_t length = (size_t)up * (size_t)taps;
+    double center = (double)(length - 1) / 2.0;
+    double sum = 0.0;
+    for (size_t k = 0; k < length; k++) {
+        double x = (double)k - center;
+        double sinc = 2 * k == length - 1 ? 2.0 * cutoff : sin(2.0 * RESAMPLE_PI * cutoff * x) / (RESAMPLE_PI * x);
+        double r = x / (center + 1.0);
+        double window = bessel_i0(beta * sqrt(1.0 - r * r)) / bessel_i0(beta);
+        double h = sinc * window;
+        sum += h;
+        // Phase p, tap t (newest first) is h[p + t * up]; store oldest first
+        size_t phase = k % up;
+        size_t tap = k / up;
+        coeffs[phase * (size_t)taps + (size_t)(taps - 1) - tap] = (float)h;
+    }
+    // Unity gain at DC once the zero-stuffed input is accounted for
+    for (size_t k = 0; k < length; k++) {
+        coeffs[k] = (float)((double)coeffs[k] * (double)up / sum);
+    }
+    return coeffs;
+}
+
+int resampler_init(unsigned int rate) {
+    free(resampler.coeffs);
+    memset(&resampler, 0, sizeof(resampler));
+    if (rate == DECTALK_SAMPLE_RATE) {
+        return 0;
+    }
+    unsigned int up, down;
+    if (resample_ratio(DECTALK_SAMPLE_RATE, rate, &up, &down) != 0) {
+        fprintf(stderr, "Cannot resample %d Hz speech to %u Hz\n", DECTALK_SAMPLE_RATE, rate);
+        return -1;
+    }
+    int taps = resample_taps;
+    float *coeffs = resample_filter(up, down, taps);
+    if (!coeffs) {
+        return -1;
+    }
+
+    resampler.coeffs = coeffs;
+    resampler.taps = taps;
+    resampler.up = up;
+    resampler.down = down;
+    resampler.phase = up;  // Pull the first source frame before the first output
+    resampler.active = 1;
+    return 0;
+}
+
+#if !defined(OMNIVOX_SSE2) && !defined(OMNIVOX_NEON)
+static float dot_product_scalar(const float *a, const float *b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#endif
+
+// taps is always a multiple of 8
+#ifdef OMNIVOX_AVX2
+__attribute__((target("avx2")))
+static float dot_product_avx2(const float *a, const float *b, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#endif
+
+#ifdef OMNIVOX_SSE2
+static float dot_product_sse2(const float *a, const float *b, int n) {
+    __m128 acc = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+}
+#endif
+
+#ifdef OMNIVOX_NEON
+static float dot_product_neon(const float *a, const float *b, int n) {
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (int i = 0; i < n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(pair, pair), 0);
+}
+#endif
+
+static float dot_product(const float *a, const float *b, int n) {
+#if defined(OMNIVOX_AVX2)
+    return cpu_has_avx2() ? dot_product_avx2(a, b, n) : dot_product_sse2(a, b, n);
+#elif defined(OMNIVOX_SSE2)
+    return dot_product_sse2(a, b, n);
+#elif defined(OMNIVOX_NEON)
+    return dot_product_neon(a, b, n);
+#else
+    return dot_product_scalar(a, b, n);
+#endif
+}
+
+// Next source frame for the resampler. Once the queue runs dry, the rest
+// of the current output buffer is fed silence without asking again.
+static const float *resampler_next_frame(int *dry) {
+    static const float silence[OUTPUT_CHANNELS];
+    if (resampler.block_pos == resampler.block_len) {
+        resampler.block_pos = 0;
+        resampler.block_len = *dry ? 0 : render_speech(resampler.block, RESAMPLE_BLOCK_FRAMES);
+        if (resampler.block_len == 0) {
+            *dry = 1;
+            resampler.block_real = 0;
+            return silence;
         }
     }
+    resampler.block_real = 1;
+    return resampler.block + resampler.block_pos++ * OUTPUT_CHANNELS;
+}
+
+// Converts speech to framesPerBuffer frames at output_rate. Returns how
+// many of them were produced from queued audio rather than silence.
+static sf_count_t render_resampled(float *out, unsigned long framesPerBuffer) {
+    uint64_t start = uv_hrtime();
+
+    // A stop discards source frames already pulled into the resampler
+    unsigned int generation = atomic_load_explicit(&playback_generation, memory_order_acquire);
+    if (generation != resampler.generation) {
+        resampler.generation = generation;
+        resampler.block_len = resampler.block_pos = 0;
+        memset(resampler.history, 0, sizeof(resampler.history));
+    }
+
+    int taps = resampler.taps;
+    int dry = 0;
+    sf_count_t frames_written = 0;
+    for (unsigned long n = 0; n < framesPerBuffer; n++) {
+        while (resampler.phase >= resampler.up) {
+            resampler.phase -= resampler.up;
+            const float *frame = resampler_next_frame(&dry);
+            resampler.history_pos = (resampler.history_pos + 1) % taps;
+            for (int ch = 0; ch < OUTPUT_CHANNELS; ch++) {
+                resampler.history[ch][resampler.history_pos] = frame[ch];
+                resampler.history[ch][resampler.history_pos + taps] = frame[ch];
+            }
+        }
+        const float *coeffs = resampler.coeffs + (size_t)resampler.phase * (size_t)taps;
+        for (int ch = 0; ch < OUTPUT_CHANNELS; ch++) {
+            out[n * OUTPUT_CHANNELS + (unsigned long)ch] =
+                dot_product(coeffs, &resampler.history[ch][resampler.history_pos + 1], taps);
+        }
+        if (resampler.block_real) {
+            frames_written = (sf_count_t)n + 1;
+        }
+        resampler.phase += resampler.down;
+    }
+
+    atomic_fetch_add_explicit(&resample_ns, uv_hrtime() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&resample_frames, framesPerBuffer, memory_order_relaxed);
+    return frames_written;
+}
+
+// Fills framesPerBuffer frames at output_rate with speech and any effects
+// mixed over it. Returns how many frames carry audio.
+sf_count_t render_audio(float *out, unsigned long framesPerBuffer) {
+    sf_count_t speech_frames = resampler.active ? render_resampled(out, framesPerBuffer)
+                                                : render_speech(out, framesPerBuffer);
+    return mix_effects(out, framesPerBuffer, speech_frames);
+}
+
+int audio_callback(const void *inputBuffer, void *outputBuffer,
+                   unsigned long framesPerBuffer,
+                   const PaStreamCallbackTimeInfo* timeInfo,
+                   PaStreamCallbackFlags statusFlags,
+                   void *userData) {
+    (void)inputBuffer;
+    (void)timeInfo;
+    (void)statusFlags;
+    (void)userData;
+
+    trace_register_thread("portaudio");
+    render_audio((float*)outputBuffer, framesPerBuffer);
+    return paContinue;
+}
+
+int portaudio_sink_start(void) {
+    PaError err;
+    err = Pa_Initialize();
+    if (err != paNoError) {
+        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+        return -1;
+    }
+
+    // Print audio device info
+    PaDeviceIndex numDevices = Pa_GetDeviceCount();
+    printf("Number of audio devices: %d\n", numDevices);
+    PaDeviceIndex defaultOutput = Pa_GetDefaultOutputDevice();
+    const PaDeviceInfo* deviceInfo = defaultOutput == paNoDevice ? NULL : Pa_GetDeviceInfo(defaultOutput);
+    if (!deviceInfo) {
+        fprintf(stderr, "No default audio output device\n");
+        Pa_Terminate();
+        return -1;
+    }
+    printf("Default output device: %s\n", deviceInfo->name);
+
+    // Without --output-rate, play at the device's native rate so the host
+    // API never has to resample behind our back
+    unsigned int rate = output_rate ? output_rate : (unsigned int)deviceInfo->defaultSampleRate;
+    if (resampler_init(rate) != 0) {
+        Pa_Terminate();
+        return -1;
+    }
+
+    // Open PortAudio stream
+    PaStreamParameters outputParameters;
+    outputParameters.device = defaultOutput;
+    outputParameters.channelCount = OUTPUT_CHANNELS;
+    outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = deviceInfo->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+
+    err = Pa_OpenStream(&audio_stream,
+                        NULL,  // No input
+                        &outputParameters,
+                        rate,
+                        FRAMES_PER_BUFFER,
+                        paClipOff,
+                        audio_callback,
+                        NULL);
+    if (err != paNoError) {
+        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+        Pa_Terminate();
+        return -1;
+    }
+
+    err = Pa_StartStream(audio_stream);
+    if (err != paNoError) {
+        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+        Pa_CloseStream(audio_stream);
+        audio_stream = NULL;
+        Pa_Terminate();
+        return -1;
+    }
+
+    output_rate = rate;
+    printf("PortAudio stream started at %u Hz\n", rate);
+    return 0;
+}
+
+void portaudio_sink_stop(void) {
+    Pa_StopStream(audio_stream);
+    Pa_CloseStream(audio_stream);
+    audio_stream = NULL;
+    Pa_Terminate();
+}
+
+// Drives render_audio for the null and WAV sinks. Real-time pacing sleeps
+// to a deadline per buffer; unthrottled mode renders back to back while
+// there is audio and only idles (without writing silence) when there is
+// none, so benchmarks measure the pipeline rather than the clock.
+void sink_thread_main(void *arg) {
+    (void)arg;
+    trace_register_thread("audio sink");
+    float buffer[FRAMES_PER_BUFFER * OUTPUT_CHANNELS];
+    uint64_t period_ns = (uint64_t)FRAMES_PER_BUFFER * 1000000000u / output_rate;
+    uint64_t deadline = uv_hrtime();
+
+    while (atomic_load(&sink_running)) {
+        sf_count_t rendered = render_audio(buffer, FRAMES_PER_BUFFER);
+        if (sink_realtime) {
+            if (wav_file) {
+                sf_writef_float(wav_file, buffer, FRAMES_PER_BUFFER);
+            }
+            deadline += period_ns;
+            uint64_t now = uv_hrtime();
+            if (deadline > now) {
+                uv_sleep((unsigned int)((deadline - now) / 1000000));
+            } else {
+                deadline = now;
+            }
+        } else if (rendered > 0) {
+            if (wav_file) {
+                sf_writef_float(wav_file, buffer, rendered);
+            }
+        } else {
+            uv_sleep(1);
+        }
+    }
+}
+
+int thread_sink_start(void) {
+    atomic_store(&sink_running, 1);
+    int r = uv_thread_create(&sink_thread, sink_thread_main, NULL);
+    if (r) {
+        fprintf(stderr, "Audio sink thread error %s\n", uv_strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+void thread_sink_stop(void) {
+    atomic_store(&sink_running, 0);
+    uv_thread_join(&sink_thread);
+}
+
+// The thread sinks have no native rate; they default to DECtalk's own
+int thread_sink_rate(void) {
+    if (!output_rate) {
+        output_rate = DECTALK_SAMPLE_RATE;
+    }
+    return resampler_init(output_rate);
+}
+
+int null_sink_start(void) {
+    if (thread_sink_rate() != 0) {
+        return -1;
+    }
+    printf("Null audio sink started (%s)\n", sink_realtime ? "real time" : "unthrottled");
+    return thread_sink_start();
+}
+
+int wav_sink_start(void) {
+    if (thread_sink_rate() != 0) {
+        return -1;
+    }
+    SF_INFO sfinfo = {0};
+    sfinfo.samplerate = (int)output_rate;
+    sfinfo.channels = OUTPUT_CHANNELS;
+    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+    wav_file = sf_open(wav_file_path, SFM_WRITE, &sfinfo);
+    if (!wav_file) {
+        fprintf(stderr, "Error opening %s: %s\n", wav_file_path, sf_strerror(NULL));
+        return -1;
+    }
+    printf("Writing audio to %s (%s)\n", wav_file_path, sink_realtime ? "real time" : "unthrottled");
+    if (thread_sink_start() != 0) {
+        sf_close(wav_file);
+        wav_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void wav_sink_stop(void) {
+    thread_sink_stop();
+    sf_close(wav_file);
+    wav_file = NULL;
+}
+
+audio_sink_t portaudio_sink = { "portaudio", portaudio_sink_start, portaudio_sink_stop };
+audio_sink_t null_sink = { "null", null_sink_start, thread_sink_stop };
+audio_sink_t wav_sink = { "wav", wav_sink_start, wav_sink_stop };
+audio_sink_t *audio_sink = &portaudio_sink;
+
+// Fixed-size blocks carved from one arena allocated at startup, so
+// steady-state use never touches malloc. A free block stores the next
+// pointer in its first bytes, so blocks are spaced stride bytes apart:
+// the block size rounded up to the strictest alignment, and never smaller
+// than a pointer. The free list is guarded by a mutex; the real-time
+// thread never allocates or frees blocks.
+typedef struct {
+    unsigned char *arena;
+    size_t block_size;
+    size_t stride;
+    size_t count;
+    void *free_list;
+    uv_mutex_t mutex;
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+    atomic_ulong fallbacks;  // Requests the pool could not serve, so malloc did
+} block_pool_t;
+
+int block_pool_init(block_pool_t *pool, size_t block_size, size_t count) {
+    size_t align = sizeof(void *) > _Alignof(max_align_t) ? sizeof(void *) : _Alignof(max_align_t);
+    pool->block_size = block_size;
+    pool->stride = (block_size + align - 1) / align * align;
+    pool->count = count;
+    pool->arena = malloc(count * pool->stride);
+    if (!pool->arena) {
+        return -1;
+    }
+    uv_mutex_init(&pool->mutex);
+    pool->free_list = NULL;
+    for (size_t i = count; i > 0; i--) {
+        void *block = pool->arena + (i - 1) * pool->stride;
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+    }
+    return 0;
+}
+
+int block_pool_owned(const block_pool_t *pool, const void *p) {
+    const unsigned char *bytes = p;
+    return pool->arena && bytes >= pool->arena && bytes < pool->arena + pool->count * pool->stride;
+}
+
+void *block_pool_alloc(block_pool_t *pool) {
+    uv_mutex_lock(&pool->mutex);
+    void *block = pool->free_list;
+    if (block) {
+        pool->free_list = *(void **)block;
+    }
+    uv_mutex_unlock(&pool->mutex);
+    if (block) {
+        size_t in_use = atomic_fetch_add(&pool->in_use, 1) + 1;
+        update_high_water(&pool->high_water, in_use);
+    }
+    return block;
+}
+
+void block_pool_free(block_pool_t *pool, void *block) {
+    uv_mutex_lock(&pool->mutex);
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    uv_mutex_unlock(&pool->mutex);
+    atomic_fetch_sub(&pool->in_use, 1);
+}
+
+void block_pool_destroy(block_pool_t *pool) {
+    free(pool->arena);
+    pool->arena = NULL;
+}
+
+// PCM block pool. Speech is copied into blocks of pcm_block_frames mono
+// samples. Blocks come back through reclaim_ring like any other item and
+// are returned to the pool by an engine. When the pool is empty, copying
+// falls back to malloc and the fallback is counted.
+block_pool_t pcm_pool;
+size_t pcm_block_frames = 0;
+size_t pcm_block_count = 0;  // 0 until set by --pcm-blocks or sized from the budget
+
+int pcm_pool_init(void) {
+    pcm_block_frames = stream_chunk_frames;
+    if (pcm_block_count == 0) {
+        pcm_block_count = (size_t)audio_budget_frames() / pcm_block_frames + 64;
+    }
+    return block_pool_init(&pcm_pool, pcm_block_frames * sizeof(int16_t), pcm_block_count);
+}
+
+// Request text pool. Every queued request's text lives in a block sized
+// for a typical line or sentence chunk, so queueing speech does not
+// allocate either; longer text falls back to malloc.
+block_pool_t text_pool;
+
+int text_pool_init(void) {
+    return block_pool_init(&text_pool, REQUEST_TEXT_BLOCK, text_budget / REQUEST_TEXT_BLOCK + 64);
+}
+
+// Room for len bytes of text and a terminator, or NULL
+char *request_text_alloc(size_t len) {
+    char *text = len < REQUEST_TEXT_BLOCK ? block_pool_alloc(&text_pool) : NULL;
+    if (!text) {
+        atomic_fetch_add(&text_pool.fallbacks, 1);
+        text = malloc(len + 1);
+    }
+    return text;
+}
+
+void request_text_free(char *text) {
+    if (block_pool_owned(&text_pool, text)) {
+        block_pool_free(&text_pool, text);
+    } else {
+        free(text);
+    }
+}
+
+void cache_entry_release(cache_entry_t *entry);
+
+void release_item_data(audio_item_t *item) {
+    if (item->resident) {
+        return;
+    } else if (item->owner) {
+        cache_entry_release(item->owner);
+    } else if (block_pool_owned(&pcm_pool, item->data)) {
+        block_pool_free(&pcm_pool, item->data);
+    } else {
+        free(item->data);
+    }
+}
+
+// Frees buffers the audio callback has finished with. reclaim_ring has a
+// single consumer, so an engine that finds another one reclaiming moves on.
+void reclaim_audio_items(void) {
+    if (uv_mutex_trylock(&reclaim_mutex) != 0) {
+        return;
+    }
+    audio_item_t item;
+    int reclaimed = 0;
+    while (audio_ring_pop(&reclaim_ring, &item) == 0) {
+        release_item_data(&item);
+        reclaimed = 1;
+    }
+    uv_mutex_unlock(&reclaim_mutex);
+    // Played items made room; a wakeup lost to the unlocked signal is
+    // covered by the waiter's timeout
+    if (reclaimed) {
+        uv_cond_broadcast(&publish_cond);
+    }
+}
+
+// Ends any producer's wait for room, after a stop or at shutdown
+void wake_publishers(void) {
+    uv_mutex_lock(&publish_mutex);
+    uv_cond_broadcast(&publish_cond);
+    uv_mutex_unlock(&publish_mutex);
+}
+
+// Producers (the engines and DECtalk's buffer callbacks) are serialized by
+// publish_mutex so audio_ring keeps a single logical producer; the
+// consumer side never touches the lock. When the ring or the audio budget
+// is full the producer waits on publish_cond for playback to catch up; an
+// item larger than the whole budget is let through once the queue is
+// empty.
+void push_audio_item(audio_item_t *item) {
+    uint64_t publish_start = uv_hrtime();
+    TRACE_BEGIN(2, "publish", item->frames);
+    uv_mutex_lock(&publish_mutex);
+    for (;;) {
+        long long queued = atomic_load(&queued_audio_frames);
+        int over_budget = queued > 0 && queued + item->frames > audio_budget_frames();
+        if (!(over_budget || audio_ring_full(&audio_ring)) || !atomic_load(&synth_running) ||
+            item->generation != atomic_load(&playback_generation)) {
+            break;
+        }
+        reclaim_audio_items();
+        uv_cond_timedwait(&publish_cond, &publish_mutex, (uint64_t)PUBLISH_WAIT_MS * 1000000);
+    }
+    int stale = item->generation != atomic_load(&playback_generation);
+    int pushed = stale ? -1 : audio_ring_push(&audio_ring, item);
+    if (pushed == 0) {
+        long long queued = atomic_fetch_add(&queued_audio_frames, item->frames) + item->frames;
+        if (queued > atomic_load(&metrics.audio_frames_high_water)) {
+            atomic_store(&metrics.audio_frames_high_water, queued);
+        }
+        update_high_water(&metrics.audio_items_high_water, audio_ring_depth(&audio_ring));
+    }
+    uv_mutex_unlock(&publish_mutex);
+    TRACE_END(2, "publish");
+    TRACE_COUNTER(1, "queued frames", atomic_load(&queued_audio_frames));
+    record_latency(STAGE_PUBLISH, uv_hrtime() - publish_start);
+
+    if (pushed != 0) {
+        release_item_data(item);
+    }
+}
+
+// Queues a one-shot sound to play over whatever else is playing. Called
+// only from the loop thread. Takes ownership of the item's data either way.
+int queue_effect(audio_item_t *item) {
+    reclaim_audio_items();
+    item->generation = atomic_load(&playback_generation);
+    item->sound_frame = -1;
+    if (audio_ring_push(&effect_ring, item) != 0) {
+        atomic_fetch_add(&metrics.effects_dropped, 1);
+        release_item_data(item);
+        return -1;
+    }
+    atomic_fetch_add(&metrics.effects_queued, 1);
+    return 0;
+}
+
+int engine_has_turn(engine_t *engine) {
+    uv_mutex_lock(&reorder_mutex);
+    int turn = publish_ticket == engine->ticket;
+    uv_mutex_unlock(&reorder_mutex);
+    return turn;
+}
+
+void wait_for_turn(engine_t *engine) {
+    uv_mutex_lock(&reorder_mutex);
+    if (publish_ticket != engine->ticket) {
+        uint64_t start = uv_hrtime();
+        while (publish_ticket != engine->ticket) {
+            uv_cond_wait(&reorder_cond, &reorder_mutex);
+        }
+        atomic_fetch_add(&metrics.reorder_wait_ns, uv_hrtime() - start);
+    }
+    uv_mutex_unlock(&reorder_mutex);
+}
+
+int hold_audio_item(engine_t *engine, const audio_item_t *item) {
+    if (engine->held_count == engine->held_capacity) {
+        size_t capacity = engine->held_capacity ? engine->held_capacity * 2 : 16;
+        audio_item_t *held = realloc(engine->held, capacity * sizeof(audio_item_t));
+        if (!held) {
+            return -1;
+        }
+        engine->held = held;
+        engine->held_capacity = capacity;
+    }
+    engine->held[engine->held_count++] = *item;
+    atomic_fetch_add(&metrics.reorder_holds, 1);
+    return 0;
+}
+
+void release_held_items(engine_t *engine) {
+    for (size_t i = 0; i < engine->held_count; i++) {
+        push_audio_item(&engine->held[i]);
+    }
+    engine->held_count = 0;
+}
+
+// Whether a stop has landed since the engine took its request. The letter
+// bank's engine serves no request, so it is never stale.
+int engine_stale(const engine_t *engine) {
+    return !engine->render_only && engine->generation != atomic_load(&playback_generation);
+}
+
+// Stamps audio with the engine's current request and queues it for
+// playback, or holds it while an earlier ticket is still publishing.
+// NULL data queues that many frames of silence.
+void publish_audio_item(engine_t *engine, int16_t *data, sf_count_t frames, cache_entry_t *owner) {
+    if (engine->render_only || engine_stale(engine)) {
+        // The letter bank's engine (capture_audio already has the samples),
+        // or audio a stop has made stale; neither waits for its turn
+        audio_item_t unused = { .data = data, .owner = owner };
+        release_item_data(&unused);
+        return;
+    }
+    audio_item_t item = {
+        .source = data ? SOURCE_PCM : SOURCE_SILENCE,
+        .data = data,
+        .frames = frames,
+        .gain = { SPEECH_GAIN_LEFT, SPEECH_GAIN_RIGHT },
+        .generation = engine->generation,
+        .received_at = engine->received_at,
+        .sound_frame = -1,
+        .owner = owner
+    };
+
+    if (atomic_exchange(&engine->first_chunk_pending, 0)) {
+        record_latency(STAGE_FIRST_CHUNK, uv_hrtime() - engine->started_at);
+    }
+    if (data && atomic_load(&engine->sound_pending)) {
+        item.sound_frame = first_sound_frame(data, frames);
+        if (item.sound_frame >= 0) {
+            atomic_store(&engine->sound_pending, 0);
+        }
+    }
+
+    if (!engine_has_turn(engine)) {
+        if (hold_audio_item(engine, &item) == 0) {
+            return;
+        }
+        wait_for_turn(engine);
+    }
+    release_held_items(engine);
+    push_audio_item(&item);
+}
+
+// Publishes what the engine held back once every earlier ticket is done,
+// then passes the turn on.
+void finish_ticket(engine_t *engine) {
+    wait_for_turn(engine);
+    release_held_items(engine);
+    uv_mutex_lock(&reorder_mutex);
+    publish_ticket++;
+    uv_mutex_unlock(&reorder_mutex);
+    uv_cond_broadcast(&reorder_cond);
+}
+
+// Takes a pool block (or, for oversized input or an empty pool, a fresh
+// allocation) and copies DECtalk's WAVE_FORMAT_1M16 PCM into it as is.
+int16_t *copy_pcm16(const int16_t *samples, sf_count_t frames) {
+    uint64_t start = uv_hrtime();
+    int16_t *out = NULL;
+    if ((size_t)frames <= pcm_block_frames) {
+        out = block_pool_alloc(&pcm_pool);
+        if (!out) {
+            // Blocks may be waiting in reclaim_ring
+            reclaim_audio_items();
+            out = block_pool_alloc(&pcm_pool);
+        }
+    }
+    if (!out) {
+        atomic_fetch_add(&pcm_pool.fallbacks, 1);
+        out = malloc((size_t)frames * sizeof(int16_t));
+    }
+    if (!out) {
+        return NULL;
+    }
+    memcpy(out, samples, (size_t)frames * sizeof(int16_t));
+    record_latency(STAGE_COPY, uv_hrtime() - start);
+    return out;
+}
+
+// Cache of synthesized utterances. Emacspeak repeats short strings
+// constantly, so finished audio for texts up to CACHE_MAX_TEXT bytes is
+// kept, keyed by a hash of the text and the whole voice state, and evicted
+// least recently used first once cache_budget is exceeded. The table and
+// LRU list are guarded by cache_mutex; the reference count is atomic so
+// the last queued item can drop an evicted entry without taking it.
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;  // FNV-1a
+    }
+    return hash;
+}
+
+// The ints before inline_voice pack without padding; the bytes after
+// them may not, so inline_voice is hashed on its own
+uint64_t utterance_hash(const char *text, const voice_state_t *voice) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = hash_bytes(hash, text, strlen(text));
+    hash = hash_bytes(hash, voice, offsetof(voice_state_t, inline_voice));
+    return hash_bytes(hash, &voice->inline_voice, sizeof(voice->inline_voice));
+}
+
+int same_voice(const voice_state_t *a, const voice_state_t *b) {
+    return a->rate == b->rate && a->punctuation == b->punctuation && a->capitalize == b->capitalize &&
+           a->allcaps_beep == b->allcaps_beep && a->split_caps == b->split_caps &&
+           a->inline_voice == b->inline_voice;
+}
+
+// Audio is only cached under a voice its key fully describes
+int voice_cacheable(const voice_state_t *voice) {
+    return voice->inline_voice != INLINE_VOICE_UNKNOWN;
+}
+
+// One allocation holds the entry, a copy of its audio and its text. This
+// is the only malloc left on the speech path once the pools are warm:
+// caching a newly synthesized phrase, or promoting a phrase file hit.
+// Returns an unlinked entry holding one reference, or NULL.
+cache_entry_t *cache_entry_create(const char *text, const voice_state_t *voice, const int16_t *pcm,
+                                  sf_count_t frames) {
+    size_t bytes = (size_t)frames * sizeof(int16_t);
+    size_t len = strlen(text);
+    cache_entry_t *entry = malloc(sizeof(cache_entry_t) + bytes + len + 1);
+    if (!entry) {
+        return NULL;
+    }
+    entry->data = (int16_t *)(void *)(entry + 1);
+    entry->text = (char *)entry->data + bytes;
+    memcpy(entry->data, pcm, bytes);
+    memcpy(entry->text, text, len + 1);
+    entry->hash = utterance_hash(text, voice);
+    entry->voice = *voice;
+    entry->frames = frames;
+    entry->bytes = sizeof(cache_entry_t) + bytes + len + 1;
+    entry->hash_next = entry->lru_prev = entry->lru_next = NULL;
+    atomic_init(&entry->refs, 1);
+    return entry;
+}
+
+void cache_entry_release(cache_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry);
+    }
+}
+
+void cache_unlink(cache_entry_t *entry) {
+    cache_entry_t **slot = &cache_table[entry->hash & (CACHE_TABLE_SIZE - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache_lru_tail = entry->lru_prev;
+    }
+    cache_bytes -= entry->bytes;
+}
+
+void cache_push_front(cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_lru_head;
+    if (cache_lru_head) {
+        cache_lru_head->lru_prev = entry;
+    }
+    cache_lru_head = entry;
+    if (!cache_lru_tail) {
+        cache_lru_tail = entry;
+    }
+}
+
+// Entries still referenced by queued items stay alive until they play
+void cache_evict_to(size_t budget) {
+    while (cache_bytes > budget && cache_lru_tail) {
+        cache_entry_t *victim = cache_lru_tail;
+        cache_unlink(victim);
+        atomic_fetch_add(&metrics.cache_evictions, 1);
+        cache_entry_release(victim);
+    }
+}
+
+cache_entry_t *cache_lookup(const char *text, const voice_state_t *voice) {
+    uint64_t hash = utterance_hash(text, voice);
+    for (cache_entry_t *entry = cache_table[hash & (CACHE_TABLE_SIZE - 1)]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && same_voice(&entry->voice, voice) && strcmp(entry->text, text) == 0) {
+            // Move to the front of the LRU list
+            if (entry != cache_lru_head) {
+                entry->lru_prev->lru_next = entry->lru_next;
+                if (entry->lru_next) {
+                    entry->lru_next->lru_prev = entry->lru_prev;
+                } else {
+                    cache_lru_tail = entry->lru_prev;
+                }
+                cache_push_front(entry);
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Hands the entry's reference to the cache, evicting to make room
+void cache_link(cache_entry_t *entry) {
+    cache_evict_to(entry->bytes < cache_budget ? cache_budget - entry->bytes : 0);
+    cache_entry_t **slot = &cache_table[entry->hash & (CACHE_TABLE_SIZE - 1)];
+    entry->hash_next = *slot;
+    *slot = entry;
+    cache_push_front(entry);
+    cache_bytes += entry->bytes;
+    atomic_fetch_add(&metrics.cache_insertions, 1);
+}
+
+// Copies the audio into a new entry; returns NULL if it does not fit
+cache_entry_t *cache_insert(const char *text, const voice_state_t *voice, const int16_t *pcm, sf_count_t frames) {
+    if ((size_t)frames * sizeof(int16_t) > cache_budget) {
+        return NULL;
+    }
+    cache_entry_t *entry = cache_entry_create(text, voice, pcm, frames);
+    if (entry) {
+        cache_link(entry);
+    }
+    return entry;
+}
+
+void cache_clear(void) {
+    cache_evict_to(0);
+}
+
+// Auditory icon bank. Emacspeak names icons by path in a and p commands;
+// each file is decoded once with libsndfile, mixed down to mono and
+// resampled to output_rate, then kept resident as 16-bit PCM. At 48 kHz
+// that is about four times what DECtalk's rate would take, a few hundred
+// KB for a typical theme, but icons keep their content above 5.5 kHz that
+// DECtalk's rate cannot carry. A file that fails to load is remembered,
+// so it is reported once and not decoded again on every play. Playing an
+// icon queues an item that borrows the bank's buffer, so every play after
+// the first is a pointer handoff to the mixer. --icons preloads a whole
+// theme directory at startup; anything else loads on first use. The bank
+// belongs to the loop thread.
+typedef struct icon_s {
+    char *path;
+    int16_t *data;  // NULL for a file that failed to load
+    sf_count_t frames;
+    struct icon_s *next;
+} icon_t;
+
+icon_t *icon_table[ICON_TABLE_SIZE];
+size_t icon_count = 0;
+size_t icon_bytes = 0;
+const char *icon_dir = NULL;
+
+// Resamples a whole mono signal to output_rate with the playback filter
+// design, compensating for the filter's delay, and stores it as 16-bit PCM.
+int16_t *icon_convert(const float *mono, sf_count_t frames, unsigned int rate, sf_count_t *converted) {
+    unsigned int up = 1, down = 1;
+    float *coeffs = NULL;
+    int taps = MAX_RESAMPLE_TAPS;
+    if (rate != output_rate) {
+        if (resample_ratio(rate, output_rate, &up, &down) != 0) {
+            return NULL;
+        }
+        // Keep the filter as long in output samples when decimating
+        taps *= (int)((down + up - 1) / up);
+        if (!(coeffs = resample_filter(up, down, taps))) {
+            return NULL;
+        }
+    }
+
+    sf_count_t count = (sf_count_t)((uint64_t)frames * up / down);
+    int16_t *pcm = malloc((size_t)(count > 0 ? count : 1) * sizeof(int16_t));
+    if (!pcm) {
+        free(coeffs);
+        return NULL;
+    }
+    uint64_t center = ((uint64_t)up * (uint64_t)taps - 1) / 2;
+    for (sf_count_t n = 0; n < count; n++) {
+        float sample = 0.0f;
+        if (!coeffs) {
+            sample = mono[n];
+        } else {
+            uint64_t k = (uint64_t)n * down + center;
+            sf_count_t newest = (sf_count_t)(k / up);
+            const float *phase = coeffs + (k % up) * (uint64_t)taps;
+            for (int t = 0; t < taps; t++) {
+                sf_count_t j = newest - t;
+                if (j >= 0 && j < frames) {
+                    sample += phase[taps - 1 - t] * mono[j];
+                }
+            }
+        }
+        sample *= 32768.0f;
+        sample = sample > 32767.0f ? 32767.0f : sample < -32768.0f ? -32768.0f : sample;
+        pcm[n] = (int16_t)sample;
+    }
+    free(coeffs);
+    *converted = count;
+    return pcm;
+}
+
+icon_t *icon_insert(const char *path, int16_t *pcm, sf_count_t frames) {
+    icon_t *icon = malloc(sizeof(icon_t));
+    size_t len = strlen(path);
+    char *copy = malloc(len + 1);
+    if (!icon || !copy) {
+        free(icon);
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy, path, len + 1);
+    icon->path = copy;
+    icon->data = pcm;
+    icon->frames = frames;
+    icon_t **slot = &icon_table[hash_bytes(0xcbf29ce484222325ULL, path, len) & (ICON_TABLE_SIZE - 1)];
+    icon->next = *slot;
+    *slot = icon;
+    return icon;
+}
+
+int16_t *icon_decode(const char *path, int quiet, sf_count_t *frames) {
+    SF_INFO info = {0};
+    SNDFILE *file = sf_open(path, SFM_READ, &info);
+    if (!file) {
+        if (!quiet) {
+            fprintf(stderr, "Cannot open auditory icon %s: %s\n", path, sf_strerror(NULL));
+        }
+        return NULL;
+    }
+    if (info.channels < 1 || info.samplerate < 1 || info.frames < 1 ||
+        info.frames > (sf_count_t)info.samplerate * ICON_MAX_SECONDS) {
+        if (!quiet) {
+            fprintf(stderr, "Unsupported auditory icon %s\n", path);
+        }
+        sf_close(file);
+        return NULL;
+    }
+
+    float *samples = malloc((size_t)info.frames * (size_t)info.channels * sizeof(float));
+    sf_count_t read = samples ? sf_readf_float(file, samples, info.frames) : 0;
+    sf_close(file);
+    for (sf_count_t i = 0; i < read; i++) {
+        float sum = 0.0f;
+        for (int ch = 0; ch < info.channels; ch++) {
+            sum += samples[i * info.channels + ch];
+        }
+        samples[i] = sum / (float)info.channels;
+    }
+    int16_t *pcm = read > 0 ? icon_convert(samples, read, (unsigned int)info.samplerate, frames) : NULL;
+    free(samples);
+    if (!pcm && !quiet) {
+        fprintf(stderr, "Cannot decode auditory icon %s\n", path);
+    }
+    return pcm;
+}
+
+// Decodes a sound file into the bank. quiet skips the error messages and
+// does not remember the failure, for preloading a directory that may hold
+// other files. Returns NULL if the file cannot be played.
+icon_t *icon_load(const char *path, int quiet) {
+    sf_count_t frames = 0;
+    int16_t *pcm = icon_decode(path, quiet, &frames);
+    if (!pcm) {
+        if (!quiet) {
+            icon_insert(path, NULL, 0);
+        }
+        return NULL;
+    }
+    icon_t *icon = icon_insert(path, pcm, frames);
+    if (!icon) {
+        free(pcm);
+        return NULL;
+    }
+    icon_count++;
+    icon_bytes += (size_t)frames * sizeof(int16_t);
+    atomic_fetch_add(&metrics.icons_loaded, 1);
+    return icon;
+}
+
+icon_t *icon_lookup(const char *path) {
+    icon_t *icon = icon_table[hash_bytes(0xcbf29ce484222325ULL, path, strlen(path)) & (ICON_TABLE_SIZE - 1)];
+    while (icon && strcmp(icon->path, path) != 0) {
+        icon = icon->next;
+    }
+    if (!icon) {
+        return icon_load(path, 0);
+    }
+    return icon->data ? icon : NULL;
+}
+
+// Decodes every sound file in dir. Returns -1 if the directory can't be read.
+int icon_preload(const char *dir) {
+    uv_fs_t req;
+    int r = uv_fs_scandir(uv_default_loop(), &req, dir, 0, NULL);
+    if (r < 0) {
+        fprintf(stderr, "Cannot read icon directory %s: %s\n", dir, uv_strerror(r));
+        uv_fs_req_cleanup(&req);
+        return -1;
+    }
+    uv_dirent_t entry;
+    char path[4096];
+    while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+        if (entry.type != UV_DIRENT_FILE && entry.type != UV_DIRENT_UNKNOWN) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry.name) < (int)sizeof(path)) {
+            icon_load(path, 1);
+        }
+    }
+    uv_fs_req_cleanup(&req);
+    printf("Loaded %zu auditory icons (%zu KB)\n", icon_count, icon_bytes / 1024);
+    return 0;
+}
+
+void icon_bank_free(void) {
+    for (size_t i = 0; i < ICON_TABLE_SIZE; i++) {
+        icon_t *icon = icon_table[i];
+        while (icon) {
+            icon_t *next = icon->next;
+            free(icon->path);
+            free(icon->data);
+            free(icon);
+            icon = next;
+        }
+        icon_table[i] = NULL;
+    }
+}
+
+// Mixes an icon over speech. Emacspeak's a and p both play immediately.
+void play_icon(const char *path) {
+    icon_t *icon = icon_lookup(path);
+    if (!icon) {
+        atomic_fetch_add(&metrics.icons_failed, 1);
+        return;
+    }
+    audio_item_t item = {
+        .data = icon->data,
+        .frames = icon->frames,
+        .gain = { ICON_GAIN, ICON_GAIN },
+        .resident = 1
+    };
+    if (queue_effect(&item) == 0) {
+        atomic_fetch_add(&metrics.icons_played, 1);
+    }
+}
+
+// Persistent phrase cache. One file, mapped shared, holds a header page, a
+// fixed table of PHRASE_SLOTS index slots and page-aligned blobs of mono
+// 16-bit samples, so a new process reuses earlier synthesis without reading
+// the file. The header records the DECtalk version and a fingerprint of
+// the dictionary; a file made by anything else is rebuilt. Blobs are
+// placed first fit between live ones, found by walking the live slots in
+// blob order, and when nothing fits the least recently used phrase is
+// evicted, one played only once before one that keeps coming back. Like
+// the in-memory cache, it is guarded by cache_mutex.
+#ifndef _WIN32
+
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t sample_rate;
+    uint64_t file_size;
+    uint32_t slot_count;
+    uint32_t reserved;
+    uint64_t clock;  // Bumped on every use; slots keep the value as last_used
+    uint64_t dictionary_size;
+    uint64_t dictionary_hash;
+    char dectalk_version[128];
+} phrase_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;  // From the start of the file, page aligned
+    uint64_t frames;
+    uint64_t last_used;
+    uint64_t inline_voice;
+    uint32_t uses;  // Stores and plays
+    uint32_t text_len;  // 0 marks a free slot; written last
+    int32_t voice[5];
+    char text[CACHE_MAX_TEXT + 1];
+} phrase_slot_t;
+
+#define PHRASE_BLOBS_START \
+    ((sizeof(phrase_header_t) + PHRASE_PAGE_SIZE - 1) / PHRASE_PAGE_SIZE * PHRASE_PAGE_SIZE + \
+     (PHRASE_SLOTS * sizeof(phrase_slot_t) + PHRASE_PAGE_SIZE - 1) / PHRASE_PAGE_SIZE * PHRASE_PAGE_SIZE)
+
+int phrase_fd = -1;
+unsigned char *phrase_map = NULL;
+size_t phrase_map_size = 0;
+phrase_header_t *phrase_header = NULL;
+phrase_slot_t *phrase_slots = NULL;
+int32_t phrase_buckets[PHRASE_SLOTS];  // Rebuilt from the slots on open
+int32_t phrase_chain[PHRASE_SLOTS];
+int32_t phrase_first_blob = -1;        // Live slots in blob order, also rebuilt on open
+int32_t phrase_next_blob[PHRASE_SLOTS];
+int32_t phrase_prev_blob[PHRASE_SLOTS];
+
+void phrase_voice(const voice_state_t *voice, int32_t out[5]) {
+    out[0] = voice->rate;
+    out[1] = voice->punctuation;
+    out[2] = voice->capitalize;
+    out[3] = voice->allcaps_beep;
+    out[4] = voice->split_caps;
+}
+
+// Size and content hash of the dictionary file, or zeros if it is missing
+void dictionary_fingerprint(const char *path, uint64_t *size, uint64_t *hash) {
+    *size = 0;
+    *hash = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            *size = (uint64_t)st.st_size;
+            *hash = hash_bytes(0xcbf29ce484222325ULL, data, (size_t)st.st_size);
+            munmap(data, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+}
+
+void phrase_link(int32_t slot) {
+    uint32_t bucket = (uint32_t)(phrase_slots[slot].hash & (PHRASE_SLOTS - 1));
+    phrase_chain[slot] = phrase_buckets[bucket];
+    phrase_buckets[bucket] = slot;
+}
+
+// Puts slot in blob order after prev, or first if prev is -1
+void phrase_link_blob(int32_t slot, int32_t prev) {
+    int32_t next = prev < 0 ? phrase_first_blob : phrase_next_blob[prev];
+    phrase_prev_blob[slot] = prev;
+    phrase_next_blob[slot] = next;
+    if (prev < 0) {
+        phrase_first_blob = slot;
+    } else {
+        phrase_next_blob[prev] = slot;
+    }
+    if (next >= 0) {
+        phrase_prev_blob[next] = slot;
+    }
+}
+
+void phrase_evict(int32_t slot) {
+    int32_t *link = &phrase_buckets[phrase_slots[slot].hash & (PHRASE_SLOTS - 1)];
+    while (*link != slot) {
+        link = &phrase_chain[*link];
+    }
+    *link = phrase_chain[slot];
+
+    int32_t prev = phrase_prev_blob[slot], next = phrase_next_blob[slot];
+    if (prev < 0) {
+        phrase_first_blob = next;
+    } else {
+        phrase_next_blob[prev] = next;
+    }
+    if (next >= 0) {
+        phrase_prev_blob[next] = prev;
+    }
+    phrase_slots[slot].text_len = 0;
+    atomic_fetch_add(&metrics.phrase_evictions, 1);
+}
+
+int phrase_header_valid(uint64_t dictionary_size, uint64_t dictionary_hash) {
+    return memcmp(phrase_header->magic, PHRASE_CACHE_MAGIC, 8) == 0 &&
+           phrase_header->format == PHRASE_CACHE_FORMAT &&
+           phrase_header->sample_rate == DECTALK_SAMPLE_RATE &&
+           phrase_header->file_size == phrase_map_size &&
+           phrase_header->slot_count == PHRASE_SLOTS &&
+           phrase_header->dictionary_size == dictionary_size &&
+           phrase_header->dictionary_hash == dictionary_hash &&
+           strncmp(phrase_header->dectalk_version, dectalk_version, sizeof(phrase_header->dectalk_version)) == 0;
+}
+
+int compare_slot_offsets(const void *a, const void *b) {
+    uint64_t x = phrase_slots[*(const int32_t *)a].offset;
+    uint64_t y = phrase_slots[*(const int32_t *)b].offset;
+    return (x > y) - (x < y);
+}
+
+uint64_t phrase_blob_end(const phrase_slot_t *entry) {
+    uint64_t blob = entry->frames * sizeof(int16_t);
+    return entry->offset + (blob + PHRASE_PAGE_SIZE - 1) / PHRASE_PAGE_SIZE * PHRASE_PAGE_SIZE;
+}
+
+// Fills order with the live slots sorted by blob offset. Only used when
+// the file is opened; stores keep the blob list in order as they go.
+size_t phrase_sort_slots(int32_t *order) {
+    size_t live = 0;
+    for (int32_t i = 0; i < PHRASE_SLOTS; i++) {
+        if (phrase_slots[i].text_len > 0) {
+            order[live++] = i;
+        }
+    }
+    qsort(order, live, sizeof(int32_t), compare_slot_offsets);
+    return live;
+}
+
+// A file that passes the header check can still hold torn or damaged
+// slots; each live slot must name a terminated text and a blob inside
+// the file that overlaps no other.
+int phrase_slots_valid(void) {
+    for (int32_t i = 0; i < PHRASE_SLOTS; i++) {
+        const phrase_slot_t *entry = &phrase_slots[i];
+        if (entry->text_len == 0) {
+            continue;
+        }
+        if (entry->text_len > CACHE_MAX_TEXT || entry->text[entry->text_len] != '\0' ||
+            memchr(entry->text, '\0', entry->text_len) != NULL ||
+            entry->offset < PHRASE_BLOBS_START || entry->offset % PHRASE_PAGE_SIZE != 0 ||
+            entry->offset >= phrase_map_size || entry->frames == 0 ||
+            entry->frames > (phrase_map_size - entry->offset) / sizeof(int16_t)) {
+            return 0;
+        }
+    }
+    static int32_t order[PHRASE_SLOTS];
+    size_t live = phrase_sort_slots(order);
+    for (size_t i = 1; i < live; i++) {
+        if (phrase_slots[order[i]].offset < phrase_blob_end(&phrase_slots[order[i - 1]])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int phrase_cache_open(const char *path, size_t size, const char *dictionary) {
+    size = size / PHRASE_PAGE_SIZE * PHRASE_PAGE_SIZE;
+    if (size <= PHRASE_BLOBS_START) {
+        fprintf(stderr, "Phrase cache must be larger than its %zu byte index\n", (size_t)PHRASE_BLOBS_START);
+        return -1;
+    }
+
+    phrase_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (phrase_fd < 0) {
+        fprintf(stderr, "Failed to open phrase cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Two servers rewriting the same file would corrupt each other's blobs
+    if (flock(phrase_fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Phrase cache %s is in use by another process\n", path);
+        close(phrase_fd);
+        phrase_fd = -1;
+        return -1;
+    }
+
+    struct stat st;
+    int reuse = fstat(phrase_fd, &st) == 0 && (size_t)st.st_size == size;
+    if (!reuse && (ftruncate(phrase_fd, 0) != 0 || ftruncate(phrase_fd, (off_t)size) != 0)) {
+        fprintf(stderr, "Failed to size phrase cache %s: %s\n", path, strerror(errno));
+        close(phrase_fd);
+        phrase_fd = -1;
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, phrase_fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map phrase cache %s: %s\n", path, strerror(errno));
+        close(phrase_fd);
+        phrase_fd = -1;
+        return -1;
+    }
+    phrase_map = map;
+    phrase_map_size = size;
+    phrase_header = map;
+    phrase_slots = (phrase_slot_t *)(phrase_map + PHRASE_PAGE_SIZE);
+
+    uint64_t dictionary_size, dictionary_hash;
+    dictionary_fingerprint(dictionary, &dictionary_size, &dictionary_hash);
+    int valid = reuse && phrase_header_valid(dictionary_size, dictionary_hash);
+    if (reuse && !valid) {
+        fprintf(stderr, "Phrase cache %s was built for another DECtalk or dictionary; rebuilding\n", path);
+    } else if (valid && !phrase_slots_valid()) {
+        fprintf(stderr, "Phrase cache %s is corrupt; rebuilding\n", path);
+        valid = 0;
+    }
+    if (!valid) {
+        memset(phrase_map, 0, PHRASE_BLOBS_START);
+        memcpy(phrase_header->magic, PHRASE_CACHE_MAGIC, 8);
+        phrase_header->format = PHRASE_CACHE_FORMAT;
+        phrase_header->sample_rate = DECTALK_SAMPLE_RATE;
+        phrase_header->file_size = size;
+        phrase_header->slot_count = PHRASE_SLOTS;
+        phrase_header->dictionary_size = dictionary_size;
+        phrase_header->dictionary_hash = dictionary_hash;
+        snprintf(phrase_header->dectalk_version, sizeof(phrase_header->dectalk_version), "%s", dectalk_version);
+    }
+
+    static int32_t order[PHRASE_SLOTS];
+    size_t phrases = phrase_sort_slots(order);
+    for (int32_t i = 0; i < PHRASE_SLOTS; i++) {
+        phrase_buckets[i] = -1;
+    }
+    phrase_first_blob = -1;
+    for (size_t i = 0; i < phrases; i++) {
+        phrase_link(order[i]);
+        phrase_link_blob(order[i], i > 0 ? order[i - 1] : -1);
+    }
+    printf("Phrase cache %s mapped with %zu phrases\n", path, phrases);
+    return 0;
+}
+
+void phrase_cache_close(void) {
+    if (!phrase_map) {
+        return;
+    }
+    msync(phrase_map, phrase_map_size, MS_ASYNC);
+    munmap(phrase_map, phrase_map_size);
+    close(phrase_fd);
+    phrase_map = NULL;
+    phrase_fd = -1;
+}
+
+int32_t phrase_find(const char *text, const voice_state_t *voice) {
+    uint64_t hash = utterance_hash(text, voice);
+    int32_t packed[5];
+    phrase_voice(voice, packed);
+    for (int32_t slot = phrase_buckets[hash & (PHRASE_SLOTS - 1)]; slot >= 0; slot = phrase_chain[slot]) {
+        phrase_slot_t *entry = &phrase_slots[slot];
+        if (entry->hash == hash && memcmp(entry->voice, packed, sizeof(packed)) == 0 &&
+            entry->inline_voice == voice->inline_voice && strcmp(entry->text, text) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// The least recently used phrase among those stored and never played,
+// so a run of one-off text doesn't push out phrases that keep coming
+// back; the least recently used of all once every phrase has been played.
+int32_t phrase_victim(void) {
+    int32_t once = -1, any = -1;
+    for (int32_t i = 0; i < PHRASE_SLOTS; i++) {
+        const phrase_slot_t *entry = &phrase_slots[i];
+        if (entry->text_len == 0) {
+            continue;
+        }
+        if (any < 0 || entry->last_used < phrase_slots[any].last_used) {
+            any = i;
+        }
+        if (entry->uses <= 1 && (once < 0 || entry->last_used < phrase_slots[once].last_used)) {
+            once = i;
+        }
+    }
+    return once >= 0 ? once : any;
+}
+
+// First gap between live blobs that holds bytes, or 0 if none does. *prev
+// is set to the live slot just before the gap, or -1.
+uint64_t phrase_find_gap(uint64_t bytes, int32_t *prev) {
+    uint64_t cursor = PHRASE_BLOBS_START;
+    *prev = -1;
+    for (int32_t slot = phrase_first_blob; slot >= 0; slot = phrase_next_blob[slot]) {
+        phrase_slot_t *entry = &phrase_slots[slot];
+        if (entry->offset - cursor >= bytes) {
+            return cursor;
+        }
+        cursor = phrase_blob_end(entry);
+        *prev = slot;
+    }
+    return phrase_map_size - cursor >= bytes ? cursor : 0;
+}
+
+void phrase_cache_store(const char *text, const voice_state_t *voice, const int16_t *pcm, sf_count_t frames) {
+    uint64_t bytes = (uint64_t)frames * sizeof(int16_t);
+    bytes = (bytes + PHRASE_PAGE_SIZE - 1) / PHRASE_PAGE_SIZE * PHRASE_PAGE_SIZE;
+    if (!phrase_map || bytes > phrase_map_size - PHRASE_BLOBS_START || phrase_find(text, voice) >= 0) {
+        return;
+    }
+
+    int32_t slot = -1;
+    for (int32_t i = 0; i < PHRASE_SLOTS && slot < 0; i++) {
+        if (phrase_slots[i].text_len == 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        slot = phrase_victim();
+        phrase_evict(slot);
+    }
+
+    int32_t prev;
+    uint64_t offset;
+    while ((offset = phrase_find_gap(bytes, &prev)) == 0) {
+        phrase_evict(phrase_victim());
+    }
+
+    memcpy(phrase_map + offset, pcm, (size_t)frames * sizeof(int16_t));
+
+    phrase_slot_t *entry = &phrase_slots[slot];
+    size_t len = strlen(text);
+    entry->hash = utterance_hash(text, voice);
+    entry->offset = offset;
+    entry->frames = (uint64_t)frames;
+    entry->last_used = ++phrase_header->clock;
+    entry->uses = 1;
+    entry->inline_voice = voice->inline_voice;
+    phrase_voice(voice, entry->voice);
+    memcpy(entry->text, text, len + 1);
+    entry->text_len = (uint32_t)len;
+    phrase_link(slot);
+    phrase_link_blob(slot, prev);
+    atomic_fetch_add(&metrics.phrase_stores, 1);
+}
+
+// Queues a phrase from the file and promotes it into the in-memory cache.
+// Returns 1 on a hit.
+int play_phrase(engine_t *engine, const char *text, const voice_state_t *voice) {
+    if (!phrase_map || !voice_cacheable(voice)) {
+        return 0;
+    }
+    uv_mutex_lock(&cache_mutex);
+    int32_t slot = phrase_find(text, voice);
+    if (slot < 0) {
+        uv_mutex_unlock(&cache_mutex);
+        atomic_fetch_add(&metrics.phrase_misses, 1);
+        return 0;
+    }
+    phrase_slot_t *entry = &phrase_slots[slot];
+    // The file can be rewritten once the lock is dropped, so the audio is
+    // copied out into an entry; the item holds one reference and the
+    // in-memory cache, if enabled, takes the other.
+    cache_entry_t *cached = cache_entry_create(text, voice, (const int16_t *)(const void *)(phrase_map + entry->offset),
+                                               (sf_count_t)entry->frames);
+    if (!cached) {
+        uv_mutex_unlock(&cache_mutex);
+        return 0;
+    }
+    entry->last_used = ++phrase_header->clock;
+    entry->uses++;
+    atomic_fetch_add(&metrics.phrase_hits, 1);
+
+    if (cache_budget > 0 && (size_t)cached->frames * sizeof(int16_t) <= cache_budget) {
+        atomic_fetch_add(&cached->refs, 1);
+        cache_link(cached);
+    }
+    uv_mutex_unlock(&cache_mutex);
+    publish_audio_item(engine, cached->data, cached->frames, cached);
+    return 1;
+}
+
+#else
+
+int phrase_cache_open(const char *path, size_t size, const char *dictionary) {
+    (void)size;
+    (void)dictionary;
+    fprintf(stderr, "Phrase cache %s is not supported on this platform\n", path);
+    return -1;
+}
+
+void phrase_cache_close(void) {
+}
+
+void phrase_cache_store(const char *text, const voice_state_t *voice, const int16_t *pcm, sf_count_t frames) {
+    (void)text;
+    (void)voice;
+    (void)pcm;
+    (void)frames;
+}
+
+int play_phrase(engine_t *engine, const char *text, const voice_state_t *voice) {
+    (void)engine;
+    (void)text;
+    (void)voice;
+    return 0;
+}
+
+#endif
+
+// Collects a request's audio while it streams so it can be cached once
+// DECtalk finishes. Chunks arrive on the engine's thread or on DECtalk's
+// callback thread while the engine is blocked in Sync, never both at once.
+void capture_begin(engine_t *engine, const char *text, const voice_state_t *voice) {
+    engine->capture.active = (cache_budget > 0 || phrase_cache_path) && strlen(text) <= CACHE_MAX_TEXT &&
+                             voice_cacheable(voice);
+    engine->capture.frames = 0;
+}
+
+void capture_audio(engine_t *engine, const int16_t *data, sf_count_t frames) {
+    capture_buffer_t *capture = &engine->capture;
+    if (!capture->active) {
+        return;
+    }
+    if (capture->frames + frames > capture->capacity) {
+        sf_count_t capacity = capture->capacity ? capture->capacity : DECTALK_SAMPLE_RATE;
+        while (capacity < capture->frames + frames) {
+            capacity *= 2;
+        }
+        int16_t *grown = realloc(capture->data, (size_t)capacity * sizeof(int16_t));
+        if (!grown) {
+            capture->active = 0;
+            return;
+        }
+        capture->data = grown;
+        capture->capacity = capacity;
+    }
+    memcpy(capture->data + capture->frames, data, (size_t)frames * sizeof(int16_t));
+    capture->frames += frames;
+}
+
+// Caches the captured audio unless synthesis failed or was stopped
+void capture_finish(engine_t *engine, const char *text, const voice_state_t *voice, int ok) {
+    capture_buffer_t *capture = &engine->capture;
+    if (!capture->active || !ok || capture->frames == 0 ||
+        engine->generation != atomic_load(&playback_generation)) {
+        capture->active = 0;
+        return;
+    }
+    uv_mutex_lock(&cache_mutex);
+    phrase_cache_store(text, voice, capture->data, capture->frames);
+    if (cache_budget > 0) {
+        cache_insert(text, voice, capture->data, capture->frames);
+    }
+    uv_mutex_unlock(&cache_mutex);
+    capture->active = 0;
+}
+
+// Queues a cached utterance without touching DECtalk. Returns 1 on a hit.
+int play_cached(engine_t *engine, const char *text, const voice_state_t *voice) {
+    if (cache_budget == 0 || !voice_cacheable(voice)) {
+        return 0;
+    }
+    uv_mutex_lock(&cache_mutex);
+    cache_entry_t *entry = cache_lookup(text, voice);
+    if (entry) {
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    uv_mutex_unlock(&cache_mutex);
+    if (!entry) {
+        atomic_fetch_add(&metrics.cache_misses, 1);
+        return 0;
+    }
+    atomic_fetch_add(&metrics.cache_hits, 1);
+    publish_audio_item(engine, entry->data, entry->frames, entry);
+    return 1;
+}
+
+void publish_stream_buffer(engine_t *engine, LPTTS_BUFFER_T buffer) {
+    sf_count_t frames = (sf_count_t)(buffer->dwBufferLength / sizeof(int16_t));
+    if (frames == 0) {
+        return;
+    }
+    int16_t *data = copy_pcm16((const int16_t *)(const void *)buffer->lpData, frames);
+    if (!data) {
+        fprintf(stderr, "Out of memory copying speech chunk\n");
+        return;
+    }
+    capture_audio(engine, data, frames);
+    publish_audio_item(engine, data, frames, NULL);
+}
+
+int init_stream_buffers(engine_t *engine) {
+    for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+        TTS_BUFFER_T *buffer = &engine->stream_buffers[i];
+        memset(buffer, 0, sizeof(*buffer));
+        buffer->lpData = malloc(stream_chunk_frames * sizeof(int16_t));
+        if (!buffer->lpData) {
+            return -1;
+        }
+        buffer->dwMaximumBufferLength = (DWORD)(stream_chunk_frames * sizeof(int16_t));
+    }
+    return 0;
+}
+
+void free_stream_buffers(engine_t *engine) {
+    for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+        free(engine->stream_buffers[i].lpData);
+        engine->stream_buffers[i].lpData = NULL;
+    }
+}
+
+// Brings the engine in line with the request's voice. Rate goes through
+// the API; punctuation is an inline command DECtalk applies to the text
+// spoken after it in the same in-memory session.
+void apply_voice_state(engine_t *engine, const voice_state_t *voice) {
+    voice_state_t *applied = &engine->applied_voice;
+    if (voice->rate != applied->rate) {
+        MMRESULT result = TextToSpeechSetRate(engine->handle, (DWORD)voice->rate);
+        if (result != MMSYSERR_NOERROR) {
+            fprintf(stderr, "Error in TextToSpeechSetRate: %d\n", result);
+        }
+        applied->rate = voice->rate;
+    }
+    if (voice->punctuation != applied->punctuation) {
+        static char *punct_commands[] = { "[:punct none]", "[:punct some]", "[:punct all]" };
+        TextToSpeechSpeak(engine->handle, punct_commands[voice->punctuation], TTS_NORMAL);
+        applied->punctuation = voice->punctuation;
+    }
+    applied->capitalize = voice->capitalize;
+    applied->allcaps_beep = voice->allcaps_beep;
+    applied->split_caps = voice->split_caps;
+}
+
+int synthesize_streaming(engine_t *engine, char *input, const voice_state_t *voice) {
+    MMRESULT result = TextToSpeechOpenInMemory(engine->handle, WAVE_FORMAT_1M16);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechOpenInMemory: %d\n", result);
+        return -1;
+    }
+
+    atomic_store(&engine->stream_active, 1);
+    for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+        engine->stream_buffers[i].dwBufferLength = 0;
+        result = TextToSpeechAddBuffer(engine->handle, &engine->stream_buffers[i]);
+        if (result != MMSYSERR_NOERROR) {
+            fprintf(stderr, "Error in TextToSpeechAddBuffer: %d\n", result);
+            atomic_store(&engine->stream_active, 0);
+            TextToSpeechCloseInMemory(engine->handle);
+            return -1;
+        }
+    }
+
+    apply_voice_state(engine, voice);
+    int status = -1;
+    // cmd_stop's reset does nothing to a Speak that has not started yet, so
+    // look again before starting it, and reset here if a stop landed while
+    // it started; one after that is reset by cmd_stop
+    if (engine_stale(engine)) {
+        TRACE_INSTANT(1, "stale before speak", engine->generation);
+    } else if ((result = TextToSpeechSpeak(engine->handle, input, TTS_FORCE)) != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechSpeak: %d\n", result);
+    } else if (engine_stale(engine)) {
+        TextToSpeechReset(engine->handle, FALSE);
+        TRACE_INSTANT(1, "stale after speak", engine->generation);
+    } else if ((result = TextToSpeechSync(engine->handle)) != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechSync: %d\n", result);
+    } else {
+        status = 0;
+    }
+
+    // Full buffers were already published by tts_callback; flush the tail
+    atomic_store(&engine->stream_active, 0);
+    LPTTS_BUFFER_T partial = NULL;
+    if (status == 0 && !engine_stale(engine) &&
+        TextToSpeechReturnBuffer(engine->handle, &partial) == MMSYSERR_NOERROR && partial) {
+        publish_stream_buffer(engine, partial);
+    }
+
+    result = TextToSpeechCloseInMemory(engine->handle);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechCloseInMemory: %d\n", result);
+    }
+    return status;
+}
+
+// Returns 0 once the utterance's audio has been published, -1 on error
+int process_input(engine_t *engine, char* input, const voice_state_t *voice) {
+    char* newline = strchr(input, '\n');
+    if (newline) *newline = '\0';
+
+    TRACE_INSTANT(1, "input bytes", strlen(input));
+
+    reclaim_audio_items();
+
+    if (streaming_enabled) {
+        return synthesize_streaming(engine, input, voice);
+    }
+
+    MMRESULT result;
+
+    // Open in-memory output
+    result = TextToSpeechOpenInMemory(engine->handle, WAVE_FORMAT_1M16);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechOpenInMemory: %d\n", result);
+        return -1;
+    }
+
+    apply_voice_state(engine, voice);
+    if (engine_stale(engine)) {
+        TextToSpeechCloseInMemory(engine->handle);
+        return -1;
+    }
+
+    // Speak the text
+    result = TextToSpeechSpeak(engine->handle, input, TTS_FORCE);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechSpeak: %d\n", result);
+        TextToSpeechCloseInMemory(engine->handle);
+        return -1;
+    }
+    if (engine_stale(engine)) {
+        // A stop that landed while Speak started did not reach it
+        TextToSpeechReset(engine->handle, FALSE);
+        TextToSpeechCloseInMemory(engine->handle);
+        return -1;
+    }
+
+    // Synchronize to ensure speech synthesis is complete
+    result = TextToSpeechSync(engine->handle);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechSync: %d\n", result);
+        TextToSpeechCloseInMemory(engine->handle);
+        return -1;
+    }
+
+    // Retrieve the speech data
+    LPTTS_BUFFER_T ptts_buffer = NULL;
+    result = TextToSpeechReturnBuffer(engine->handle, &ptts_buffer);
+    if (result != MMSYSERR_NOERROR || ptts_buffer == NULL) {
+        fprintf(stderr, "Error in TextToSpeechReturnBuffer: %d\n", result);
+        TextToSpeechCloseInMemory(engine->handle);
+        return -1;
+    }
+
+    // Close in-memory output
+    result = TextToSpeechCloseInMemory(engine->handle);
+    if (result != MMSYSERR_NOERROR) {
+        fprintf(stderr, "Error in TextToSpeechCloseInMemory: %d\n", result);
+        free(ptts_buffer->lpData);
+        free(ptts_buffer);
+        return -1;
+    }
+
+    TRACE_INSTANT(1, "speech bytes", ptts_buffer->dwBufferLength);
+
+    // DECtalk hands back raw PCM; queue it a pool block at a time
+    const int16_t *samples = (const int16_t *)(const void *)ptts_buffer->lpData;
+    sf_count_t total = (sf_count_t)(ptts_buffer->dwBufferLength / sizeof(int16_t));
+    int status = 0;
+    for (sf_count_t done = 0; done < total; done += (sf_count_t)pcm_block_frames) {
+        sf_count_t frames = total - done < (sf_count_t)pcm_block_frames ? total - done : (sf_count_t)pcm_block_frames;
+        int16_t *data = copy_pcm16(samples + done, frames);
+        if (!data) {
+            fprintf(stderr, "Out of memory copying speech\n");
+            status = -1;
+            break;
+        }
+        capture_audio(engine, data, frames);
+        publish_audio_item(engine, data, frames, NULL);
+    }
+
+    free(ptts_buffer->lpData);
+    free(ptts_buffer);
+    return status;
+}
+
+// The voice settings in force at the end of the chunks queued so far.
+// Only commands that change how later text sounds are kept, the last of
+// each kind; tones, dials and index marks belong to their own chunk.
+enum { CARRY_VOICE, CARRY_DESIGN, CARRY_RATE, CARRY_PUNCT, CARRY_SETTINGS };
+
+typedef struct {
+    char setting[CARRY_SETTINGS][CARRY_SETTING_LENGTH];  // Without "[:" and "]"; empty if unset
+    int lost;  // A setting was too long to keep, or a command changed something not kept
+} carry_t;
+
+int command_is(const char *word, size_t len, const char *name) {
+    if (len != strlen(name)) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)word[i]) != name[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Which setting a command such as "np", "ra 300" or "punct all" changes, or -1
+int carry_kind(const char *word, size_t len) {
+    if ((len == 2 && tolower((unsigned char)word[0]) == 'n') || command_is(word, len, "name")) {
+        return CARRY_VOICE;
+    }
+    if (command_is(word, len, "dv") || command_is(word, len, "design")) {
+        return CARRY_DESIGN;
+    }
+    if (command_is(word, len, "ra") || command_is(word, len, "rate")) {
+        return CARRY_RATE;
+    }
+    if (command_is(word, len, "pu") || command_is(word, len, "punct")) {
+        return CARRY_PUNCT;
+    }
+    return -1;
+}
+
+// Commands that only affect the text around them
+int carry_transient(const char *word, size_t len) {
+    return command_is(word, len, "t") || command_is(word, len, "tone") || command_is(word, len, "dial") ||
+           command_is(word, len, "i") || command_is(word, len, "index") || command_is(word, len, "sync");
+}
+
+void carry_setting(carry_t *carry, const char *command, size_t len) {
+    size_t word = 0;
+    while (word < len && isalpha((unsigned char)command[word])) {
+        word++;
+    }
+    int kind = carry_kind(command, word);
+    if (kind < 0) {
+        carry->lost |= word > 0 && !carry_transient(command, word);
+        return;
+    }
+    char *setting = carry->setting[kind];
+    size_t used = strlen(setting);
+    if (kind == CARRY_VOICE) {
+        // A new voice starts from its own design
+        carry->setting[CARRY_DESIGN][0] = '\0';
+    } else if (kind == CARRY_DESIGN && used > 0) {
+        // Each dv sets only the parameters it names, so they accumulate
+        if (used + 2 + len < CARRY_SETTING_LENGTH) {
+            memcpy(setting + used, " :", 2);
+            memcpy(setting + used + 2, command, len);
+            setting[used + 2 + len] = '\0';
+            return;
+        }
+        // Only the latest parameters fit
+        carry->lost = 1;
+    }
+    if (len >= CARRY_SETTING_LENGTH) {
+        setting[0] = '\0';
+        carry->lost = 1;
+        return;
+    }
+    memcpy(setting, command, len);
+    setting[len] = '\0';
+}
+
+// Records the settings in the [: ] commands of text[start, end). One
+// bracket may hold several commands, as in [:np :ra 300].
+void carry_commands(carry_t *carry, const char *text, size_t start, size_t end) {
+    for (size_t i = start; i + 1 < end; i++) {
+        if (text[i] != '[' || text[i + 1] != ':') {
+            continue;
+        }
+        const char *close = memchr(text + i, ']', end - i);
+        if (!close) {
+            break;
+        }
+        const char *command = text + i + 2;
+        while (command < close) {
+            const char *next = memchr(command, ':', (size_t)(close - command));
+            const char *stop = next ? next : close;
+            while (command < stop && *command == ' ') {
+                command++;
+            }
+            size_t len = (size_t)(stop - command);
+            while (len > 0 && command[len - 1] == ' ') {
+                len--;
+            }
+            carry_setting(carry, command, len);
+            command = next ? next + 1 : close;
+        }
+        i = (size_t)(close - text);
+    }
+}
+
+// Writes the carried settings as [: ] commands. Returns the length.
+size_t carry_render(const carry_t *carry, char *out) {
+    size_t len = 0;
+    for (int kind = 0; kind < CARRY_SETTINGS; kind++) {
+        size_t setting_len = strlen(carry->setting[kind]);
+        if (setting_len > 0) {
+            memcpy(out + len, "[:", 2);
+            memcpy(out + len + 2, carry->setting[kind], setting_len);
+            out[len + 2 + setting_len] = ']';
+            len += setting_len + 3;
+        }
+    }
+    return len;
+}
+
+// Summarizes the carried settings for the cache key: 0 if there are
+// none, INLINE_VOICE_UNKNOWN once one has been lost.
+uint64_t carry_hash(const carry_t *carry) {
+    if (carry->lost) {
+        return INLINE_VOICE_UNKNOWN;
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int any = 0;
+    for (int kind = 0; kind < CARRY_SETTINGS; kind++) {
+        size_t len = strlen(carry->setting[kind]);
+        any |= len > 0;
+        hash = hash_bytes(hash, carry->setting[kind], len + 1);
+    }
+    return any && hash != INLINE_VOICE_UNKNOWN ? hash : 0;
+}
+
+// Writes the carried voice and its design as [: ] commands, naming Paul,
+// DECtalk's default, if no voice was chosen. Returns the length.
+size_t carry_render_voice(const carry_t *carry, char *out, size_t size) {
+    const char *name = carry->setting[CARRY_VOICE][0] ? carry->setting[CARRY_VOICE] : "np";
+    const char *design = carry->setting[CARRY_DESIGN];
+    int len = snprintf(out, size, "[:%s]%s%s%s", name, design[0] ? "[:" : "", design, design[0] ? "]" : "");
+    return len < 0 ? 0 : (size_t)len < size ? (size_t)len : size - 1;
+}
+
+// The settings left in force by all speech queued so far, on the loop
+// thread. Requests are stamped with them through current_voice.
+carry_t voice_carry;
+
+// Letter bank. Keystroke echo (l) is the most latency-sensitive thing
+// Emacspeak asks for, so every printable ASCII and Latin-1 character is
+// rendered ahead of time by a DECtalk instance of its own, in the
+// background at startup and again whenever the voice l uses changes. An
+// l whose character is in the bank is published from memory by whichever
+// engine takes the request; until then it is synthesized from the same
+// text like any other request. The bank is rendered after the inline
+// settings in force and keyed by them, so an [:np] retargets it too.
+cache_entry_t *letter_bank[256];  // Guarded by cache_mutex
+voice_state_t letter_bank_voice;  // The voice the bank holds, guarded by cache_mutex
+size_t letter_bank_bytes = 0;     // Guarded by cache_mutex
+int letter_bank_enabled = 1;
+uv_thread_t letter_thread;
+uv_mutex_t letter_mutex;
+uv_cond_t letter_cond;
+voice_state_t letter_target;            // Guarded by letter_mutex
+carry_t letter_target_carry;            // Inline settings letter_target stands for, guarded by letter_mutex
+unsigned int letter_rendered_serial = 0;  // Guarded by letter_mutex
+atomic_uint letter_serial = 0;          // Bumped under letter_mutex when letter_target changes
+atomic_int letter_running = 0;
+
+int letter_bankable(int c) {
+    return (c >= 32 && c < 127) || (c >= 160 && c < 256);
+}
+
+int letter_is_capital(int c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7);
+}
+
+// l always names punctuation, whatever the voice's punctuation mode
+voice_state_t letter_voice(const voice_state_t *voice) {
+    voice_state_t letter = *voice;
+    letter.punctuation = PUNCT_ALL;
+    return letter;
+}
+
+// The Latin-1 character text consists of, or 0 if it is anything longer.
+// Emacs sends UTF-8, where U+00A0 to U+00FF take two bytes.
+int letter_code(const char *text) {
+    const unsigned char *p = (const unsigned char *)text;
+    int c = 0;
+    if (p[0] && !p[1]) {
+        c = p[0];
+    } else if ((p[0] == 0xC2 || p[0] == 0xC3) && (p[1] & 0xC0) == 0x80 && !p[2]) {
+        c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+    }
+    return letter_bankable(c) ? c : 0;
+}
+
+// What DECtalk speaks for an l: the character in letter mode, raised in
+// pitch if it is a capital and the voice marks them. The raise lasts, so
+// the carried voice and design are set again after it. Brackets would
+// open a DECtalk command, so those two are named outright.
+void letter_text(int c, const voice_state_t *voice, const carry_t *carry, char *out, size_t size) {
+    char pitch_on[32] = "", pitch_off[2 * (CARRY_SETTING_LENGTH + 3)] = "";
+    if (voice->capitalize && letter_is_capital(c)) {
+        snprintf(pitch_on, sizeof(pitch_on), "[:dv ap %d]", LETTER_CAP_PITCH);
+        carry_render_voice(carry, pitch_off, sizeof(pitch_off));
+    }
+    if (c == '[' || c == ']') {
+        snprintf(out, size, "%s bracket", c == '[' ? "left" : "right");
+    } else {
+        snprintf(out, size, "%s[:say letter]%c[:say clause]%s", pitch_on, c, pitch_off);
+    }
+}
+
+// Renders one character on the letter bank's engine, after the inline
+// settings it is rendered for. Returns an entry holding one reference, or
+// NULL.
+cache_entry_t *letter_render(engine_t *engine, int c, const voice_state_t *voice, const carry_t *carry) {
+    char text[CARRY_SETTINGS * (CARRY_SETTING_LENGTH + 3) + LETTER_TEXT_MAX];
+    size_t len = carry_render(carry, text);
+    letter_text(c, voice, carry, text + len, sizeof(text) - len);
+    len += strlen(text + len);
+
+    capture_buffer_t *capture = &engine->capture;
+    capture->active = 1;
+    capture->frames = 0;
+    char input[sizeof(text)];
+    memcpy(input, text, len + 1);
+    int ok = process_input(engine, input, voice) == 0 && capture->active && capture->frames > 0;
+    capture->active = 0;
+    if (!ok) {
+        return NULL;
+    }
+
+    return cache_entry_create(text, voice, capture->data, capture->frames);
+}
+
+// Empties the bank and retargets it at voice
+void letter_bank_reset(const voice_state_t *voice) {
+    cache_entry_t *old[256];
+    uv_mutex_lock(&cache_mutex);
+    memcpy(old, letter_bank, sizeof(old));
+    memset(letter_bank, 0, sizeof(letter_bank));
+    letter_bank_voice = *voice;
+    letter_bank_bytes = 0;
+    uv_mutex_unlock(&cache_mutex);
+    for (int c = 0; c < 256; c++) {
+        if (old[c]) {
+            cache_entry_release(old[c]);
+        }
+    }
+}
+
+void letter_bank_store(int c, cache_entry_t *entry) {
+    uv_mutex_lock(&cache_mutex);
+    if (same_voice(&letter_bank_voice, &entry->voice) && !letter_bank[c]) {
+        letter_bank[c] = entry;
+        letter_bank_bytes += entry->bytes;
+        entry = NULL;
+    }
+    uv_mutex_unlock(&cache_mutex);
+    if (entry) {
+        cache_entry_release(entry);
+    }
+}
+
+// Renders the whole bank for the latest target voice, starting over
+// whenever the target changes mid-pass.
+void letter_worker(void *arg) {
+    engine_t *engine = arg;
+    trace_register_thread(engine->name);
+    uv_mutex_lock(&letter_mutex);
+    while (atomic_load(&letter_running)) {
+        unsigned int serial = atomic_load(&letter_serial);
+        if (serial == letter_rendered_serial) {
+            uv_cond_wait(&letter_cond, &letter_mutex);
+            continue;
+        }
+        voice_state_t voice = letter_target;
+        carry_t carry = letter_target_carry;
+        uv_mutex_unlock(&letter_mutex);
+
+        TRACE_BEGIN(1, "letter bank", serial);
+        uint64_t start = uv_hrtime();
+        letter_bank_reset(&voice);
+        for (int c = 0; c < 256 && atomic_load(&letter_serial) == serial && atomic_load(&letter_running); c++) {
+            if (!letter_bankable(c)) {
+                continue;
+            }
+            cache_entry_t *entry = letter_render(engine, c, &voice, &carry);
+            if (entry) {
+                letter_bank_store(c, entry);
+                atomic_fetch_add(&metrics.letters_rendered, 1);
+            }
+        }
+        atomic_fetch_add(&metrics.letter_render_ns, uv_hrtime() - start);
+        TRACE_END(1, "letter bank");
+
+        uv_mutex_lock(&letter_mutex);
+        letter_rendered_serial = serial;
+    }
+    uv_mutex_unlock(&letter_mutex);
+}
+
+// Called on the loop thread whenever the voice may have changed
+void letter_bank_refresh(void) {
+    if (!letter_bank_enabled) {
+        return;
+    }
+    voice_state_t voice = letter_voice(&current_voice);
+    if (!voice_cacheable(&voice)) {
+        return;
+    }
+    uv_mutex_lock(&letter_mutex);
+    if (atomic_load(&letter_serial) == 0 || !same_voice(&voice, &letter_target)) {
+        letter_target = voice;
+        letter_target_carry = voice_carry;
+        atomic_fetch_add(&letter_serial, 1);
+        uv_cond_signal(&letter_cond);
+    }
+    uv_mutex_unlock(&letter_mutex);
+}
+
+// Queues a character from the letter bank. Returns 1 on a hit.
+int play_letter(engine_t *engine, int c, const voice_state_t *voice) {
+    if (!letter_bank_enabled) {
+        return 0;
+    }
+    uv_mutex_lock(&cache_mutex);
+    cache_entry_t *entry = same_voice(&letter_bank_voice, voice) ? letter_bank[c] : NULL;
+    if (entry) {
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    uv_mutex_unlock(&cache_mutex);
+    if (!entry) {
+        atomic_fetch_add(&metrics.letter_misses, 1);
+        return 0;
+    }
+    atomic_fetch_add(&metrics.letter_hits, 1);
+    publish_audio_item(engine, entry->data, entry->frames, entry);
+    return 1;
+}
+
+// Doubles the request ring, unwrapping it so head starts at zero. Called
+// with synth_queue_mutex held.
+int grow_synth_queue(void) {
+    size_t capacity = synth_queue_capacity ? synth_queue_capacity * 2 : 64;
+    synth_request_t *queue = malloc(capacity * sizeof(synth_request_t));
+    if (!queue) {
+        return -1;
+    }
+    for (size_t i = 0; i < synth_queue_size; i++) {
+        queue[i] = synth_queue[(synth_queue_head + i) % synth_queue_capacity];
+    }
+    free(synth_queue);
+    synth_queue = queue;
+    synth_queue_capacity = capacity;
+    synth_queue_head = 0;
+    return 0;
+}
+
+// Queues text the caller has allocated; the queue takes ownership even on
+// failure. Never blocks on DECtalk.
+int enqueue_request(synth_request_t *request, size_t len) {
+    uint64_t enqueued_at = uv_hrtime();
+    uv_mutex_lock(&synth_queue_mutex);
+    if (synth_queue_size == synth_queue_capacity && grow_synth_queue() != 0) {
+        uv_mutex_unlock(&synth_queue_mutex);
+        fprintf(stderr, "Out of memory queueing synthesis\n");
+        request_text_free(request->text);
+        return -1;
+    }
+    size_t tail = (synth_queue_head + synth_queue_size) % synth_queue_capacity;
+    request->generation = atomic_load(&playback_generation);
+    request->received_at = line_received_at;
+    request->enqueued_at = enqueued_at;
+    synth_queue[tail] = *request;
+    synth_queue_size++;
+    size_t queued = atomic_fetch_add(&queued_text_bytes, len) + len;
+    uv_mutex_unlock(&synth_queue_mutex);
+
+    update_high_water(&metrics.text_bytes_high_water, queued);
+    record_latency(STAGE_PARSE, enqueued_at - line_received_at);
+
+    uv_cond_signal(&synth_queue_cond);
+    return 0;
+}
+
+// Where the chunk starting at start should end: after the last sentence
+// end within limit bytes, else the last clause break, else the last space.
+// DECtalk [ ] commands are never cut, even if that overruns the limit.
+size_t chunk_end(const char *text, size_t start, size_t len, size_t limit) {
+    if (len - start <= limit) {
+        return len;
+    }
+    size_t stop = start + limit;
+    size_t sentence = 0, clause = 0, space = 0;
+    int depth = 0;
+    size_t i;
+    for (i = start; i < stop || (depth > 0 && i < len); i++) {
+        char c = text[i];
+        if (c == '[') {
+            depth++;
+        } else if (c == ']' && depth > 0) {
+            depth--;
+        } else if (depth == 0 && i + 1 < len && text[i + 1] == ' ') {
+            if (c == '.' || c == '!' || c == '?') {
+                sentence = i + 1;
+            } else if (c == ',' || c == ';' || c == ':') {
+                clause = i + 1;
+            } else if (c != ' ') {
+                space = i + 1;
+            }
+        }
+    }
+    if (sentence > start) {
+        return sentence;
+    }
+    if (clause > start) {
+        return clause;
+    }
+    return space > start ? space : i;
+}
+
+// Copies text into request text after the settings in voice_carry. An
+// inline command only changes the engine that speaks it, so every request
+// repeats them to sound the same on whichever engine takes it. Sets
+// *total to the length; returns NULL if out of memory.
+char *voiced_text_alloc(const char *text, size_t len, size_t *total) {
+    char carry[CARRY_SETTINGS * (CARRY_SETTING_LENGTH + 3)];
+    size_t carry_len = carry_render(&voice_carry, carry);
+    char *copy = request_text_alloc(carry_len + len);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, carry, carry_len);
+    memcpy(copy + carry_len, text, len);
+    copy[carry_len + len] = '\0';
+    *total = carry_len + len;
+    return copy;
+}
+
+// Copies the text into the synthesis queue.
+int enqueue_synthesis(const char *text) {
+    size_t len;
+    char *copy = voiced_text_alloc(text, strlen(text), &len);
+    if (!copy) {
+        fprintf(stderr, "Out of memory queueing synthesis\n");
+        return -1;
+    }
+    synth_request_t request = { .text = copy, .voice = current_voice };
+    return enqueue_request(&request, len);
+}
+
+// Splits text longer than split_chars into chunks that synthesize and play
+// in order, so the first sentence starts playing while the rest is still
+// being synthesized. The first chunk is kept short. Chunks may run on
+// different engines, so each starts with the voice, rate and punctuation
+// settings in force where it begins.
+int enqueue_chunks(const char *text, size_t len) {
+    carry_t settings = voice_carry;
+    char carry[CARRY_SETTINGS * (CARRY_SETTING_LENGTH + 3)];
+    size_t carry_len = carry_render(&settings, carry);
+    size_t limit = split_chars / 4 > 0 ? split_chars / 4 : 1;
+    size_t start = 0;
+    unsigned long chunks = 0;
+    while (start < len) {
+        size_t end = chunk_end(text, start, len, limit);
+        char *chunk = request_text_alloc(carry_len + end - start);
+        if (!chunk) {
+            fprintf(stderr, "Out of memory queueing synthesis\n");
+            return -1;
+        }
+        memcpy(chunk, carry, carry_len);
+        memcpy(chunk + carry_len, text + start, end - start);
+        chunk[carry_len + end - start] = '\0';
+        synth_request_t request = { .text = chunk, .voice = current_voice };
+        if (enqueue_request(&request, carry_len + end - start) != 0) {
+            return -1;
+        }
+        chunks++;
+
+        carry_commands(&settings, text, start, end);
+        carry_len = carry_render(&settings, carry);
+        start = end;
+        while (start < len && text[start] == ' ') {
+            start++;
+        }
+        limit = split_chars;
+    }
+    if (chunks > 1) {
+        atomic_fetch_add(&metrics.utterances_split, 1);
+        atomic_fetch_add(&metrics.chunks_queued, chunks);
+    }
+    return 0;
+}
+
+// Queues speech, in chunks if it is long. Whatever voice settings the
+// text changes stay in force for the speech queued after it, and count
+// towards the cache key of that speech.
+int enqueue_speech(const char *text) {
+    size_t len = strlen(text);
+    int status = split_chars == 0 || len <= split_chars ? enqueue_synthesis(text) : enqueue_chunks(text, len);
+    uint64_t inline_voice = current_voice.inline_voice;
+    carry_commands(&voice_carry, text, 0, len);
+    current_voice.inline_voice = carry_hash(&voice_carry);
+    if (current_voice.inline_voice != inline_voice) {
+        letter_bank_refresh();
+    }
+    return status;
+}
+
+void synth_worker(void *arg) {
+    engine_t *engine = arg;
+    trace_register_thread(engine->name);
+
+    for (;;) {
+        uv_mutex_lock(&synth_queue_mutex);
+        while (synth_queue_size == 0 && synth_running) {
+            uv_cond_wait(&synth_queue_cond, &synth_queue_mutex);
+        }
+        if (synth_queue_size == 0) {
+            uv_mutex_unlock(&synth_queue_mutex);
+            break;
+        }
+        synth_request_t request = synth_queue[synth_queue_head];
+        synth_queue_head = (synth_queue_head + 1) % synth_queue_capacity;
+        synth_queue_size--;
+        engine->ticket = next_ticket++;
+        // Busy before the lock is released, so a stop that flushes the
+        // queue after this point knows to reset this engine
+        atomic_store(&engine->busy, 1);
+        atomic_fetch_sub(&queued_text_bytes, request.text ? strlen(request.text) : 0);
+        uv_mutex_unlock(&synth_queue_mutex);
+
+        if (request.generation == atomic_load(&playback_generation)) {
+            uint64_t started = uv_hrtime();
+            record_latency(STAGE_QUEUE_WAIT, started - request.enqueued_at);
+            engine->generation = request.generation;
+            engine->received_at = request.received_at;
+            engine->started_at = started;
+            atomic_store(&engine->first_chunk_pending, 1);
+            atomic_store(&engine->sound_pending, 1);
+            if (!request.text) {
+                // Takes its turn like speech but never touches DECtalk
+                publish_audio_item(engine, NULL, request.silence_frames, NULL);
+            } else {
+                if (!(request.letter && play_letter(engine, request.letter, &request.voice)) &&
+                    !play_cached(engine, request.text, &request.voice) &&
+                    !play_phrase(engine, request.text, &request.voice)) {
+                    TRACE_BEGIN(1, "synthesize", request.generation);
+                    capture_begin(engine, request.text, &request.voice);
+                    int status = process_input(engine, request.text, &request.voice);
+                    capture_finish(engine, request.text, &request.voice, status == 0);
+                    TRACE_END(1, "synthesize");
+                }
+                uint64_t elapsed = uv_hrtime() - started;
+                record_latency(STAGE_SYNTH, elapsed);
+                atomic_fetch_add(&engine->utterances, 1);
+                atomic_fetch_add(&engine->busy_ns, elapsed);
+            }
+        }
+        finish_ticket(engine);
+        atomic_store(&engine->busy, 0);
+        request_text_free(request.text);
+    }
+}
+
+// Sets up the rings, the PCM pool and the locks. The audio thread reads
+// the rings from its first buffer on, so this runs before any sink starts.
+int init_queues(void) {
+    // Enough descriptors for the budget filled with the smallest chunks
+    size_t ring_capacity = (size_t)(audio_budget_frames() / 256) + 64;
+    if (audio_ring_init(&audio_ring, ring_capacity) != 0 || audio_ring_init(&reclaim_ring, ring_capacity) != 0 ||
+        audio_ring_init(&effect_ring, EFFECT_RING_SIZE) != 0 || pcm_pool_init() != 0 ||
+        text_pool_init() != 0) {
+        fprintf(stderr, "Out of memory allocating audio queues\n");
+        return -1;
+    }
+    uv_mutex_init(&synth_queue_mutex);
+    uv_cond_init(&synth_queue_cond);
+    uv_mutex_init(&publish_mutex);
+    uv_cond_init(&publish_cond);
+    uv_mutex_init(&reorder_mutex);
+    uv_cond_init(&reorder_cond);
+    uv_mutex_init(&cache_mutex);
+    uv_mutex_init(&reclaim_mutex);
+    return 0;
+}
+
+int start_synth_worker(void) {
+    atomic_store(&synth_running, 1);
+    engines_started_at = uv_hrtime();
+    for (int i = 0; i < engine_count; i++) {
+        int r = uv_thread_create(&engines[i].thread, synth_worker, &engines[i]);
+        if (r) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+// Lets the engines drain what is already queued, then joins them.
+void stop_synth_worker(void) {
+    uv_mutex_lock(&synth_queue_mutex);
+    atomic_store(&synth_running, 0);
+    uv_mutex_unlock(&synth_queue_mutex);
+    uv_cond_broadcast(&synth_queue_cond);
+    wake_publishers();
+    for (int i = 0; i < engine_count; i++) {
+        uv_thread_join(&engines[i].thread);
+    }
+}
+
+// Drops queued text that no engine has started on yet.
+void flush_synth_queue(void) {
+    uv_mutex_lock(&synth_queue_mutex);
+    while (synth_queue_size > 0) {
+        request_text_free(synth_queue[synth_queue_head].text);
+        synth_queue_head = (synth_queue_head + 1) % synth_queue_capacity;
+        synth_queue_size--;
+    }
+    atomic_store(&queued_text_bytes, 0);
+    uv_mutex_unlock(&synth_queue_mutex);
+}
+
+// Emacspeak speaks the Tcl server protocol: one command per line, a bare
+// command word followed by bare or {braced} words. Parsing happens in place
+// over the line buffer: words are NUL-terminated where they end and braces
+// are stripped by pointing past them, so nothing is allocated per token.
+
+char *skip_spaces(char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+// Splits the next word off *cursor. A braced word runs to its matching
+// close brace (nesting and backslash escapes honored); an unbalanced brace
+// takes the rest of the line. Returns NULL when the line is exhausted.
+char *next_word(char **cursor) {
+    char *p = skip_spaces(*cursor);
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+
+    char *word;
+    if (*p == '{') {
+        int depth = 1;
+        word = ++p;
+        for (; *p; p++) {
+            if (*p == '\\' && p[1]) {
+                p++;
+            } else if (*p == '{') {
+                depth++;
+            } else if (*p == '}' && --depth == 0) {
+                break;
+            }
+        }
+    } else {
+        word = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r') {
+            p++;
+        }
+    }
+
+    if (*p) {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return word;
+}
+
+// Text arguments are usually braced; a bare one runs to the end of the line.
+char *text_argument(char *args) {
+    char *p = skip_spaces(args);
+    if (*p == '{') {
+        return next_word(&p);
+    }
+    size_t len = strlen(p);
+    while (len > 0 && (p[len-1] == ' ' || p[len-1] == '\r')) {
+        p[--len] = '\0';
+    }
+    return p;
+}
+
+int int_argument(char **cursor, int *value) {
+    char *word = next_word(cursor);
+    if (!word) {
+        return -1;
+    }
+    char *end;
+    long parsed = strtol(word, &end, 10);
+    if (end == word || *end != '\0' || parsed < 0 || parsed > 100000) {
+        return -1;
+    }
+    *value = (int)parsed;
+    return 0;
+}
+
+int punctuation_argument(const char *word) {
+    if (!word) return -1;
+    if (strcmp(word, "all") == 0) return PUNCT_ALL;
+    if (strcmp(word, "some") == 0) return PUNCT_SOME;
+    if (strcmp(word, "none") == 0) return PUNCT_NONE;
+    return -1;
+}
+
+void cmd_speak(char *args) {
+    char *text = text_argument(args);
+    if (*text) {
+        enqueue_speech(text);
+    }
+}
+
+// Hands the accumulated q/c text to the worker as one DECtalk call.
+void dispatch_pending_speech(void) {
+    if (pending_speech.len == 0) {
+        return;
+    }
+    if (enqueue_speech(pending_speech.data) == 0) {
+        atomic_fetch_add(&metrics.batches_dispatched, 1);
+        atomic_fetch_add(&metrics.fragments_batched, pending_speech.fragments);
+        atomic_fetch_add(&metrics.dectalk_calls_saved, pending_speech.fragments - 1);
+    }
+    pending_speech.len = 0;
+    pending_speech.fragments = 0;
+}
+
+void discard_pending_speech(void) {
+    pending_speech.len = 0;
+    pending_speech.fragments = 0;
+}
+
+// Appends one fragment to the batch, joined by a space as separate
+// DECtalk calls would have been heard. Nothing else is inserted: Emacspeak
+// splits q text wherever it likes, even mid-sentence, and a c fragment is
+// an inline command that must reach DECtalk as sent.
+void queue_fragment(const char *text) {
+    size_t len = strlen(text);
+    if (len == 0) {
+        return;
+    }
+    if (pending_speech.len + len + 2 > MAX_BATCH_LENGTH) {
+        dispatch_pending_speech();
+    }
+
+    size_t needed = pending_speech.len + len + 2;
+    if (needed > pending_speech.capacity) {
+        size_t capacity = pending_speech.capacity ? pending_speech.capacity * 2 : 256;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *data = realloc(pending_speech.data, capacity);
+        if (!data) {
+            fprintf(stderr, "Out of memory queueing speech\n");
+            return;
+        }
+        pending_speech.data = data;
+        pending_speech.capacity = capacity;
+    }
+
+    if (pending_speech.len > 0) {
+        pending_speech.data[pending_speech.len++] = ' ';
+    }
+    memcpy(pending_speech.data + pending_speech.len, text, len);
+    pending_speech.len += len;
+    pending_speech.data[pending_speech.len] = '\0';
+    pending_speech.fragments++;
+}
 
-    return paContinue;
+// q and c both add to the batch; c carries DECtalk inline commands
+void cmd_queue(char *args) {
+    queue_fragment(text_argument(args));
 }
 
-sf_count_t vio_get_filelen(void *user_data) {
-    virtual_file_t *vf = (virtual_file_t *)user_data;
-    return vf->buffer_size;
+void cmd_dispatch(char *args) {
+    (void)args;
+    dispatch_pending_speech();
 }
 
-sf_count_t vio_seek(sf_count_t offset, int whence, void *user_data) {
-    virtual_file_t *vf = (virtual_file_t *)user_data;
-    switch (whence) {
-        case SEEK_SET:
-            if (offset <= UINT32_MAX) {
-                vf->current_position = (DWORD)offset;
-            } else {
-                // Handle error
-                return -1;
-            }
-            break;
-        case SEEK_CUR:
-            if (vf->current_position + offset <= UINT32_MAX) {
-                vf->current_position += (DWORD)offset;
-            } else {
-                // Handle error
-                return -1;
-            }
-            break;
-        case SEEK_END:
-            if (vf->buffer_size + offset <= UINT32_MAX) {
-                vf->current_position = (DWORD)(vf->buffer_size + offset);
-            } else {
-                // Handle error
-                return -1;
-            }
-            break;
+// Silences everything: queued text is discarded, the generation bump makes
+// audio_callback drop what is already queued on its next buffer, and
+// TextToSpeechReset cuts short any Sync an engine is blocked in. An engine
+// that has taken a request but not yet started speaking sees the new
+// generation itself and skips it.
+void cmd_stop(char *args) {
+    (void)args;
+    atomic_store(&stop_requested_at, uv_hrtime());
+    atomic_fetch_add_explicit(&playback_generation, 1, memory_order_release);
+    atomic_fetch_add(&metrics.stops, 1);
+    TRACE_INSTANT(1, "stop", atomic_load(&playback_generation));
+    discard_pending_speech();
+    flush_synth_queue();
+    for (int i = 0; i < engine_count; i++) {
+        if (atomic_load(&engines[i].busy)) {
+            TextToSpeechReset(engines[i].handle, FALSE);
+        }
     }
-    return vf->current_position;
+    wake_publishers();
 }
 
-sf_count_t vio_read(void *ptr, sf_count_t count, void *user_data) {
-    virtual_file_t *vf = (virtual_file_t *)user_data;
-    sf_count_t to_read = (vf->current_position + count > vf->buffer_size) ? 
-                         (vf->buffer_size - vf->current_position) : count;
-    memcpy(ptr, vf->buffer + vf->current_position, (size_t)to_read);
-    vf->current_position += (DWORD)to_read;
-    return to_read;
+// l character: a single character comes from the letter bank when the
+// bank has it; anything longer is spoken as text.
+void cmd_letter(char *args) {
+    char *text = text_argument(args);
+    int c = letter_code(text);
+    if (!c) {
+        if (*text) {
+            enqueue_speech(text);
+        }
+        return;
+    }
+    voice_state_t voice = letter_voice(&current_voice);
+    char spoken[LETTER_TEXT_MAX];
+    letter_text(c, &voice, &voice_carry, spoken, sizeof(spoken));
+    size_t len;
+    char *copy = voiced_text_alloc(spoken, strlen(spoken), &len);
+    if (!copy) {
+        fprintf(stderr, "Out of memory queueing synthesis\n");
+        return;
+    }
+    synth_request_t request = { .text = copy, .voice = voice, .letter = c };
+    enqueue_request(&request, len);
 }
 
-sf_count_t vio_tell(void *user_data) {
-    virtual_file_t *vf = (virtual_file_t *)user_data;
-    return vf->current_position;
+// t frequency milliseconds: mixed over speech like an icon
+void cmd_tone(char *args) {
+    int frequency, ms;
+    if (int_argument(&args, &frequency) != 0 || int_argument(&args, &ms) != 0 ||
+        frequency < 1 || frequency > MAX_TONE_FREQUENCY || (unsigned int)frequency * 2 >= output_rate) {
+        fprintf(stderr, "Malformed tone\n");
+        return;
+    }
+    float step = 2.0f * (float)RESAMPLE_PI * (float)frequency / (float)output_rate;
+    audio_item_t item = {
+        .source = SOURCE_TONE,
+        .frames = (sf_count_t)ms * output_rate / 1000,
+        .gain = { TONE_GAIN, TONE_GAIN },
+        .tone_step = { cosf(step), sinf(step) }
+    };
+    if (item.frames > 0 && queue_effect(&item) == 0) {
+        atomic_fetch_add(&metrics.tones_played, 1);
+    }
 }
 
-// Forward declaration of GetSpeechData
-MMRESULT GetSpeechData(LPTTS_HANDLE_T handle, BYTE **buffer, DWORD *buffer_size);
+// sh milliseconds: a pause between utterances. Speech still being batched
+// by q goes out first so the pause lands after it.
+void cmd_silence(char *args) {
+    int ms;
+    if (int_argument(&args, &ms) != 0) {
+        fprintf(stderr, "Malformed silence\n");
+        return;
+    }
+    sf_count_t frames = (sf_count_t)ms * DECTALK_SAMPLE_RATE / 1000;
+    if (frames == 0) {
+        return;
+    }
+    dispatch_pending_speech();
+    synth_request_t request = { .voice = current_voice, .silence_frames = frames };
+    if (enqueue_request(&request, 0) == 0) {
+        atomic_fetch_add(&metrics.pauses_queued, 1);
+        atomic_fetch_add(&metrics.pause_frames, frames);
+    }
+}
 
-// Add these functions before process_input
-static sf_count_t mem_get_filelen(void *user_data) {
-    return ((TTS_BUFFER_T*)user_data)->dwBufferLength;
+void cmd_play_icon(char *args) {
+    char *path = text_argument(args);
+    if (*path) {
+        play_icon(path);
+    }
 }
 
-static sf_count_t mem_seek(sf_count_t offset, int whence, void *user_data) {
-    TTS_BUFFER_T *buf = (TTS_BUFFER_T*)user_data;
-    switch(whence) {
-        case SEEK_SET: buf->dwReserved = (DWORD)offset; break;
-        case SEEK_CUR: buf->dwReserved += (DWORD)offset; break;
-        case SEEK_END: buf->dwReserved = buf->dwBufferLength + (DWORD)offset; break;
+void cmd_set_speech_rate(char *args) {
+    int rate;
+    if (int_argument(&args, &rate) == 0) {
+        current_voice.rate = rate;
+        letter_bank_refresh();
     }
-    return buf->dwReserved;
 }
 
-static sf_count_t mem_read(void *ptr, sf_count_t count, void *user_data) {
-    TTS_BUFFER_T *buf = (TTS_BUFFER_T*)user_data;
-    sf_count_t to_read = (buf->dwReserved + count > buf->dwBufferLength) ?
-                         (buf->dwBufferLength - buf->dwReserved) : count;
-    memcpy(ptr, buf->lpData + buf->dwReserved, (size_t)to_read);
-    buf->dwReserved += (DWORD)to_read;
-    return to_read;
+void cmd_set_punctuations(char *args) {
+    int punct = punctuation_argument(next_word(&args));
+    if (punct >= 0) {
+        current_voice.punctuation = punct;
+    }
 }
 
-static sf_count_t mem_tell(void *user_data) {
-    return ((TTS_BUFFER_T*)user_data)->dwReserved;
+// tts_sync_state punct capitalize allcaps splitcaps rate
+void cmd_sync_state(char *args) {
+    voice_state_t voice = current_voice;
+    int punct = punctuation_argument(next_word(&args));
+    if (punct < 0 ||
+        int_argument(&args, &voice.capitalize) != 0 ||
+        int_argument(&args, &voice.allcaps_beep) != 0 ||
+        int_argument(&args, &voice.split_caps) != 0 ||
+        int_argument(&args, &voice.rate) != 0) {
+        fprintf(stderr, "Malformed tts_sync_state\n");
+        return;
+    }
+    voice.punctuation = punct;
+    current_voice = voice;
+    letter_bank_refresh();
 }
 
-void process_input(char* input) {
-    char* newline = strchr(input, '\n');
-    if (newline) *newline = '\0';
+void cmd_version(char *args) {
+    (void)args;
+    char text[256];
+    snprintf(text, sizeof(text), "omnivox using DECtalk %s", dectalk_version);
+    enqueue_synthesis(text);
+}
 
-    printf("Processing input: %s\n", input);
+typedef struct {
+    const char *name;
+    void (*handler)(char *args);
+} command_t;
 
-    uv_mutex_lock(&audio_queue_mutex);
-    if (audio_queue_size >= MAX_AUDIO_QUEUE) {
-        printf("Audio queue full, skipping input\n");
-        uv_mutex_unlock(&audio_queue_mutex);
-        return;
-    }
+// Sorted by name for bsearch
+static const command_t commands[] = {
+    { "a", cmd_play_icon },
+    { "c", cmd_queue },
+    { "d", cmd_dispatch },
+    { "l", cmd_letter },
+    { "p", cmd_play_icon },
+    { "q", cmd_queue },
+    { "s", cmd_stop },
+    { "sh", cmd_silence },
+    { "t", cmd_tone },
+    { "tts_say", cmd_speak },
+    { "tts_set_punctuations", cmd_set_punctuations },
+    { "tts_set_speech_rate", cmd_set_speech_rate },
+    { "tts_sync_state", cmd_sync_state },
+    { "ttssay", cmd_speak },
+    { "version", cmd_version },
+};
 
-    MMRESULT result;
+int compare_command(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const command_t *)entry)->name);
+}
 
-    // Open in-memory output
-    result = TextToSpeechOpenInMemory(tts_handle, WAVE_FORMAT_1M16);
-    if (result != MMSYSERR_NOERROR) {
-        fprintf(stderr, "Error in TextToSpeechOpenInMemory: %d\n", result);
-        uv_mutex_unlock(&audio_queue_mutex);
+void dispatch_command(char *line) {
+    char *cursor = line;
+    char *name = next_word(&cursor);
+    if (!name) {
         return;
     }
-
-    // Speak the text
-    result = TextToSpeechSpeak(tts_handle, input, TTS_FORCE);
-    if (result != MMSYSERR_NOERROR) {
-        fprintf(stderr, "Error in TextToSpeechSpeak: %d\n", result);
-        TextToSpeechCloseInMemory(tts_handle);
-        uv_mutex_unlock(&audio_queue_mutex);
+    const command_t *command = bsearch(name, commands, sizeof(commands) / sizeof(commands[0]),
+                                       sizeof(commands[0]), compare_command);
+    if (!command) {
+        fprintf(stderr, "Unknown command: %s\n", name);
         return;
     }
+    TRACE_BEGIN(2, "command", 0);
+    command->handler(cursor);
+    TRACE_END(2, "command");
+}
 
-    // Synchronize to ensure speech synthesis is complete
-    result = TextToSpeechSync(tts_handle);
-    if (result != MMSYSERR_NOERROR) {
-        fprintf(stderr, "Error in TextToSpeechSync: %d\n", result);
-        TextToSpeechCloseInMemory(tts_handle);
-        uv_mutex_unlock(&audio_queue_mutex);
-        return;
-    }
+void reject_line(line_buffer_t *lines) {
+    fprintf(stderr, "Rejected a line longer than %zu bytes\n", max_line_length);
+    atomic_fetch_add(&metrics.lines_rejected, 1);
+    lines->len = 0;
+    lines->discarding = 1;
+}
 
-    // Retrieve the speech data
-    LPTTS_BUFFER_T ptts_buffer = NULL;
-    result = TextToSpeechReturnBuffer(tts_handle, &ptts_buffer);
-    if (result != MMSYSERR_NOERROR || ptts_buffer == NULL) {
-        fprintf(stderr, "Error in TextToSpeechReturnBuffer: %d\n", result);
-        TextToSpeechCloseInMemory(tts_handle);
-        uv_mutex_unlock(&audio_queue_mutex);
-        return;
+// Appends the start of a line that continues in the next read
+int append_partial_line(line_buffer_t *lines, const char *data, size_t len) {
+    if (lines->len + len > max_line_length) {
+        reject_line(lines);
+        return -1;
     }
+    if (lines->len + len + 1 > lines->capacity) {
+        size_t capacity = lines->capacity ? lines->capacity : 256;
+        while (capacity < lines->len + len + 1) {
+            capacity *= 2;
+        }
+        char *grown = realloc(lines->data, capacity);
+        if (!grown) {
+            fprintf(stderr, "Out of memory assembling a line\n");
+            reject_line(lines);
+            return -1;
+        }
+        lines->data = grown;
+        lines->capacity = capacity;
+    }
+    memcpy(lines->data + lines->len, data, len);
+    lines->len += len;
+    atomic_fetch_add(&metrics.bytes_assembled, len);
+    return 0;
+}
 
-    // Close in-memory output
-    result = TextToSpeechCloseInMemory(tts_handle);
-    if (result != MMSYSERR_NOERROR) {
-        fprintf(stderr, "Error in TextToSpeechCloseInMemory: %d\n", result);
-        free(ptts_buffer->lpData);
-        free(ptts_buffer);
-        uv_mutex_unlock(&audio_queue_mutex);
-        return;
+void release_line_buffer(line_buffer_t *lines) {
+    lines->len = 0;
+    if (lines->capacity > LINE_BUFFER_KEEP) {
+        free(lines->data);
+        lines->data = NULL;
+        lines->capacity = 0;
     }
+}
 
-    printf("Generated speech in memory, size: %d bytes\n", ptts_buffer->dwBufferLength);
+// Splits a read into lines with memchr. Lines that arrive whole are
+// terminated and parsed where they sit in the read buffer; only a line
+// split across reads is copied. A line longer than max_line_length is
+// dropped whole rather than being cut into separate commands.
+void feed_lines(line_buffer_t *lines, char *data, size_t len) {
+    atomic_fetch_add(&metrics.bytes_read, len);
+    while (len > 0) {
+        char *newline = memchr(data, '\n', len);
+        if (!newline) {
+            if (!lines->discarding) {
+                append_partial_line(lines, data, len);
+            }
+            return;
+        }
+        size_t line_len = (size_t)(newline - data);
+        size_t rest = len - line_len - 1;
+        if (lines->discarding) {
+            lines->discarding = 0;
+        } else if (lines->len > 0) {
+            if (append_partial_line(lines, data, line_len) == 0) {
+                lines->data[lines->len] = '\0';
+                dispatch_command(lines->data);
+            }
+            lines->discarding = 0;
+            release_line_buffer(lines);
+        } else if (line_len > max_line_length) {
+            reject_line(lines);
+            lines->discarding = 0;
+        } else {
+            *newline = '\0';
+            dispatch_command(data);
+        }
+        data = newline + 1;
+        len = rest;
+    }
+}
 
-    // Process the speech data
-    SF_INFO sfinfo = {0};
-    sfinfo.samplerate = 11025;  // Assuming 11025 Hz sample rate, adjust if needed
-    sfinfo.channels = 1;        // Mono output
-    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-
-    SF_VIRTUAL_IO virtual_io = {
-        .get_filelen = mem_get_filelen,
-        .seek = mem_seek,
-        .read = mem_read,
-        .write = NULL,
-        .tell = mem_tell
-    };
+int pipeline_over_budget(void) {
+    return atomic_load(&queued_text_bytes) > text_budget ||
+           atomic_load(&queued_audio_frames) > audio_budget_frames();
+}
 
-    ptts_buffer->dwReserved = 0;  // Use dwReserved as current position
+void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf);
 
-    SNDFILE *infile = sf_open_virtual(&virtual_io, SFM_READ, &sfinfo, ptts_buffer);
-    if (!infile) {
-        fprintf(stderr, "Error opening virtual file: %s\n", sf_strerror(NULL));
-        free(ptts_buffer->lpData);
-        free(ptts_buffer);
-        uv_mutex_unlock(&audio_queue_mutex);
+void on_resume_check(uv_timer_t *handle) {
+    (void)handle;
+    if (atomic_load(&queued_text_bytes) > text_budget / 2 ||
+        atomic_load(&queued_audio_frames) > audio_budget_frames() / 2) {
         return;
     }
+    for (client_t *c = clients; c; c = c->next) {
+        uv_read_start(&c->handle.stream, alloc_buffer, on_read);
+    }
+    reading_paused = 0;
+    uv_timer_stop(&resume_timer);
+}
 
-    float *input_data = malloc((size_t)sfinfo.frames * sizeof(float));
-    sf_readf_float(infile, input_data, sfinfo.frames);
-    sf_close(infile);
+// Backpressure: stop reading from every client and poll until the
+// backlog has drained, rather than dropping speech.
+void pause_reading(void) {
+    if (reading_paused) {
+        return;
+    }
+    for (client_t *c = clients; c; c = c->next) {
+        uv_read_stop(&c->handle.stream);
+    }
+    reading_paused = 1;
+    atomic_fetch_add(&metrics.read_pauses, 1);
+    uv_timer_start(&resume_timer, on_resume_check, RESUME_CHECK_INTERVAL_MS, RESUME_CHECK_INTERVAL_MS);
+}
 
-    float *processed_data;
-    sf_count_t processed_frames;
-    process_wav_in_memory(input_data, sfinfo.frames, sfinfo.samplerate, &processed_data, &processed_frames);
+void on_client_close(uv_handle_t *handle) {
+    client_t *c = (client_t *)handle->data;
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        clients = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    free(c->read_buffer);
+    free(c->lines.data);
+    free(c);
+}
 
-    free(input_data);
-    free(ptts_buffer->lpData);
-    free(ptts_buffer);
+client_t *add_client(void) {
+    client_t *c = (client_t *)malloc(sizeof(client_t));
+    if (!c) {
+        return NULL;
+    }
+    c->read_buffer = NULL;
+    memset(&c->lines, 0, sizeof(c->lines));
+    c->handle.stream.data = c;
+    c->prev = NULL;
+    c->next = clients;
+    if (clients) {
+        clients->prev = c;
+    }
+    clients = c;
+    return c;
+}
 
-    audio_queue[audio_queue_size].data = processed_data;
-    audio_queue[audio_queue_size].frames = processed_frames;
-    audio_queue[audio_queue_size].samplerate = sfinfo.samplerate;
-    audio_queue[audio_queue_size].channels = 2;  // We're converting to stereo
-    audio_queue[audio_queue_size].is_processed = 1;
-    audio_queue[audio_queue_size].is_playing = 0;
-    audio_queue_size++;
-    uv_mutex_unlock(&audio_queue_mutex);
-
-    uv_cond_signal(&audio_queue_cond);
-}void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
+void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
     client_t* c = (client_t*)client->data;
 
     if (nread < 0) {
         if (nread != UV_EOF)
             fprintf(stderr, "Read error %s\n", uv_strerror((int)nread));
-        uv_close((uv_handle_t*) client, NULL);
-        return;
-    }
-
-    if (nread > 0) {
-        for (ssize_t i = 0; i < nread; i++) {
-            if (buf->base[i] == '\n' || c->buffer_len == MAX_LINE_LENGTH - 1) {
-                c->buffer[c->buffer_len] = '\0';
-                process_input(c->buffer);
-                c->buffer_len = 0;
-            } else {
-                c->buffer[c->buffer_len++] = buf->base[i];
-            }
+        uv_close((uv_handle_t*) client, on_client_close);
+    } else if (nread > 0) {
+        atomic_fetch_add(&metrics.reads, 1);
+        line_received_at = uv_hrtime();
+        feed_lines(&c->lines, buf->base, (size_t)nread);
+        if (pipeline_over_budget()) {
+            pause_reading();
         }
     }
+}
 
-    if (buf->base)
-        free(buf->base);
+void start_client(client_t *c) {
+    if (!reading_paused) {
+        uv_read_start(&c->handle.stream, alloc_buffer, on_read);
+    }
 }
 
 void on_new_connection(uv_stream_t *server, int status) {
@@ -348,150 +4087,583 @@ void on_new_connection(uv_stream_t *server, int status) {
         return;
     }
 
-    client_t *client = (client_t*)malloc(sizeof(client_t));
-    uv_tcp_init(loop, &client->handle);
-    client->buffer_len = 0;
-    client->handle.data = client;
+    client_t *client = add_client();
+    if (!client) {
+        fprintf(stderr, "Out of memory accepting connection\n");
+        return;
+    }
+    uv_tcp_init(loop, &client->handle.tcp);
+    client->handle.stream.data = client;
 
-    if (uv_accept(server, (uv_stream_t*)&client->handle) == 0) {
-        uv_read_start((uv_stream_t*)&client->handle, alloc_buffer, on_read);
+    if (uv_accept(server, &client->handle.stream) == 0) {
+        start_client(client);
     }
     else {
-        uv_close((uv_handle_t*)&client->handle, NULL);
+        uv_close((uv_handle_t*)&client->handle.tcp, on_client_close);
     }
 }
 
-void stdin_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
-    if (nread < 0) {
-        if (nread == UV_EOF) {
-            // end of file
-            uv_close((uv_handle_t*)stream, NULL);
+void print_metrics(FILE *out) {
+    fprintf(out, "Batches dispatched: %lu, fragments: %lu, DECtalk calls saved: %lu\n",
+            atomic_load(&metrics.batches_dispatched),
+            atomic_load(&metrics.fragments_batched),
+            atomic_load(&metrics.dectalk_calls_saved));
+    fprintf(out, "Sentence chunking: %lu long utterances split into %lu chunks\n",
+            atomic_load(&metrics.utterances_split),
+            atomic_load(&metrics.chunks_queued));
+    fprintf(out, "Stops: %lu, stop-to-silence last: %.3f ms, max: %.3f ms\n",
+            atomic_load(&metrics.stops),
+            (double)atomic_load(&metrics.stop_latency_last_ns) / 1e6,
+            (double)atomic_load(&metrics.stop_latency_max_ns) / 1e6);
+    // Queued audio costs sizeof(int16_t) per frame whatever the output format
+    fprintf(out, "Audio queue: %zu items, %.1f s (high water %zu items, %.1f s, %.1f MB); text queue: %zu bytes (high water %zu); read pauses: %lu\n",
+            audio_ring_depth(&audio_ring),
+            (double)atomic_load(&queued_audio_frames) / DECTALK_SAMPLE_RATE,
+            atomic_load(&metrics.audio_items_high_water),
+            (double)atomic_load(&metrics.audio_frames_high_water) / DECTALK_SAMPLE_RATE,
+            (double)atomic_load(&metrics.audio_frames_high_water) * sizeof(int16_t) / (1024.0 * 1024.0),
+            atomic_load(&queued_text_bytes),
+            atomic_load(&metrics.text_bytes_high_water),
+            atomic_load(&metrics.read_pauses));
+    fprintf(out, "Read buffers: %lu allocated for %lu reads\n",
+            atomic_load(&metrics.read_buffer_allocations),
+            atomic_load(&metrics.reads));
+    fprintf(out, "Input: %lu bytes read, %lu copied to assemble split lines, %lu oversized lines rejected\n",
+            atomic_load(&metrics.bytes_read),
+            atomic_load(&metrics.bytes_assembled),
+            atomic_load(&metrics.lines_rejected));
+    fprintf(out, "Cache: %lu hits, %lu misses, %lu inserted, %lu evicted, %zu of %zu bytes used\n",
+            atomic_load(&metrics.cache_hits),
+            atomic_load(&metrics.cache_misses),
+            atomic_load(&metrics.cache_insertions),
+            atomic_load(&metrics.cache_evictions),
+            cache_bytes, cache_budget);
+    if (phrase_cache_path) {
+        fprintf(out, "Phrase cache: %lu hits, %lu misses, %lu stored, %lu evicted\n",
+                atomic_load(&metrics.phrase_hits),
+                atomic_load(&metrics.phrase_misses),
+                atomic_load(&metrics.phrase_stores),
+                atomic_load(&metrics.phrase_evictions));
+    }
+    // Busy time over wall time shows how well synthesis scales with --engines
+    uint64_t busy = 0;
+    for (int i = 0; i < engine_count; i++) {
+        busy += atomic_load(&engines[i].busy_ns);
+    }
+    uint64_t wall = uv_hrtime() - engines_started_at;
+    fprintf(out, "PCM pool: %zu blocks of %zu frames (%.1f MB), %zu in use (high water %zu), %lu fallback allocations\n",
+            pcm_pool.count, pcm_block_frames,
+            (double)(pcm_pool.count * pcm_pool.stride) / (1024.0 * 1024.0),
+            atomic_load(&pcm_pool.in_use),
+            atomic_load(&pcm_pool.high_water),
+            atomic_load(&pcm_pool.fallbacks));
+    fprintf(out, "Text pool: %zu blocks of %zu bytes, %zu in use (high water %zu), %lu fallback allocations\n",
+            text_pool.count, text_pool.block_size,
+            atomic_load(&text_pool.in_use),
+            atomic_load(&text_pool.high_water),
+            atomic_load(&text_pool.fallbacks));
+    if (resampler.active) {
+        // Includes pulling source frames, so it is the whole render cost
+        uint64_t output_frames = atomic_load(&resample_frames);
+        double seconds = (double)output_frames / (double)output_rate;
+        fprintf(out, "Resampler: %d Hz to %u Hz (%u/%u), %d taps, %.2f ms delay, %.3f ms CPU per second of audio\n",
+                DECTALK_SAMPLE_RATE, output_rate, resampler.up, resampler.down, resampler.taps,
+                (double)resampler.taps * 500.0 / DECTALK_SAMPLE_RATE,
+                seconds > 0 ? (double)atomic_load(&resample_ns) / 1e6 / seconds : 0.0);
+    } else {
+        fprintf(out, "Output: %u Hz, no resampling\n", output_rate);
+    }
+    fprintf(out, "Icons: %zu resident (%zu KB), %lu loaded, %lu played, %lu failed\n",
+            icon_count, icon_bytes / 1024,
+            atomic_load(&metrics.icons_loaded),
+            atomic_load(&metrics.icons_played),
+            atomic_load(&metrics.icons_failed));
+    if (letter_bank_enabled) {
+        int ready = 0;
+        uv_mutex_lock(&cache_mutex);
+        for (int c = 0; c < 256; c++) {
+            ready += letter_bank[c] != NULL;
         }
-    } else if (nread > 0) {
-        buf->base[nread] = '\0';  // Null-terminate the input
-        char *cmd = strtok(buf->base, " ");
-        if (cmd && strcmp(cmd, "ttssay") == 0) {
-            char *text = strtok(NULL, "\n");
-            if (text) {
-                process_input(text);
-            } else {
-                printf("Usage: ttssay <text to speak>\n");
-            }
-        } else {
-            printf("Unknown command. Use 'ttssay <text>' to speak.\n");
+        size_t bytes = letter_bank_bytes;
+        uv_mutex_unlock(&cache_mutex);
+        fprintf(out, "Letter bank: %d characters ready (%zu KB), %lu hits, %lu misses, %lu rendered in %.3f s\n",
+                ready, bytes / 1024,
+                atomic_load(&metrics.letter_hits),
+                atomic_load(&metrics.letter_misses),
+                atomic_load(&metrics.letters_rendered),
+                (double)atomic_load(&metrics.letter_render_ns) / 1e9);
+    }
+    fprintf(out, "Generated: %lu tones, %lu pauses (%.1f s)\n",
+            atomic_load(&metrics.tones_played),
+            atomic_load(&metrics.pauses_queued),
+            (double)atomic_load(&metrics.pause_frames) / DECTALK_SAMPLE_RATE);
+    fprintf(out, "Mixer: %lu effects queued, %lu dropped; CPU per second of audio by sources mixed:",
+            atomic_load(&metrics.effects_queued),
+            atomic_load(&metrics.effects_dropped));
+    for (int sources = 1; sources <= MAX_MIX_VOICES + 1; sources++) {
+        unsigned long frames = atomic_load(&metrics.mix_frames[sources]);
+        if (frames > 0) {
+            fprintf(out, " %d: %.3f ms", sources,
+                    (double)atomic_load(&metrics.mix_ns[sources]) / 1e6 / ((double)frames / output_rate));
+        }
+    }
+    fprintf(out, "\n");
+    fprintf(out, "Engines: %d, parallelism %.2f, reorder: %lu items held, %.3f ms waiting for turn\n",
+            engine_count,
+            wall > 0 ? (double)busy / (double)wall : 0.0,
+            atomic_load(&metrics.reorder_holds),
+            (double)atomic_load(&metrics.reorder_wait_ns) / 1e6);
+    for (int i = 0; i < engine_count; i++) {
+        fprintf(out, "Engine %d: %lu utterances, %.3f s busy\n", i,
+                atomic_load(&engines[i].utterances),
+                (double)atomic_load(&engines[i].busy_ns) / 1e9);
+    }
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        if (atomic_load(&stage_latency[stage].total) == 0) {
+            continue;
         }
+        fprintf(out, "Latency %-12s p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  (n=%lu)\n",
+                stage_names[stage],
+                (double)latency_percentile_us(stage, 0.5) / 1000.0,
+                (double)latency_percentile_us(stage, 0.99) / 1000.0,
+                (double)latency_percentile_us(stage, 0.999) / 1000.0,
+                atomic_load(&stage_latency[stage].total));
     }
+}
+
+int shutdown_requested = 0;
 
-    if (buf->base)
-        free(buf->base);
+void on_signal(uv_signal_t *handle, int signum) {
+#ifdef SIGUSR1
+    if (signum == SIGUSR1) {
+        print_metrics(stderr);
+        return;
+    }
+#endif
+    (void)signum;
+    shutdown_requested = 1;
+    uv_stop(handle->loop);
 }
 
 void check_portaudio_stream(uv_timer_t* handle) {
     (void)handle;
-    if (Pa_IsStreamActive(audio_stream)) {
+    if (audio_stream && Pa_IsStreamActive(audio_stream)) {
       //printf("PortAudio stream is active\n");
     } else {
       //printf("PortAudio stream is not active\n");
     }
 }
 
+// DECtalk calls this with TTS_MSG_BUFFER and the buffer in lParam2 each
+// time one of an engine's stream_buffers is full; dwParam3 is the engine
+// index given to TextToSpeechStartup. Publish the buffer and hand it
+// straight back so DECtalk can keep writing. This runs on DECtalk's own
+// thread, so it never resets the engine it is called from.
 void tts_callback(LONG lParam1, LONG lParam2, DWORD dwParam3, UINT uiParam4) {
     (void)lParam1;
-    (void)lParam2;
-    (void)dwParam3;
-    (void)uiParam4;
-    // Handle TTS callbacks here
+    trace_register_thread("dectalk");
+
+    if (uiParam4 != TTS_MSG_BUFFER || (dwParam3 >= (DWORD)engine_count && dwParam3 != LETTER_ENGINE)) {
+        return;
+    }
+    engine_t *engine = &engines[dwParam3];
+    LPTTS_BUFFER_T buffer = (LPTTS_BUFFER_T)(intptr_t)lParam2;
+    if (!buffer || !atomic_load(&engine->stream_active)) {
+        return;
+    }
+    // Audio a stop has overtaken is dropped; cmd_stop or the engine
+    // thread resets the Speak
+    if (!engine_stale(engine)) {
+        publish_stream_buffer(engine, buffer);
+    }
+    buffer->dwBufferLength = 0;
+    TextToSpeechAddBuffer(engine->handle, buffer);
 }
 
-int main(void) {
-    MMRESULT result = TextToSpeechStartup(&tts_handle, 0, 0, tts_callback, 0);
+// Starts the DECtalk instance in engines[index] with its own stream buffers
+int start_engine(int index, const char *name) {
+    engine_t *engine = &engines[index];
+    engine->index = index;
+    snprintf(engine->name, sizeof(engine->name), "%s", name);
+    engine->applied_voice = (voice_state_t){ 0, -1, 0, 0, 0, 0 };
+    if (init_stream_buffers(engine) != 0) {
+        fprintf(stderr, "Failed to allocate stream buffers\n");
+        return -1;
+    }
+    MMRESULT result = TextToSpeechStartup(&engine->handle, 0, 0, tts_callback, (LONG)index);
     if (result != MMSYSERR_NOERROR) {
-        fprintf(stderr, "Failed to initialize TTS\n");
-        return 1;
+        fprintf(stderr, "Failed to initialize TTS engine %d\n", index);
+        engine->handle = NULL;
+        return -1;
     }
+    return 0;
+}
 
-    PaError err;
-    err = Pa_Initialize();
-    if (err != paNoError) {
-        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
-        return 1;
+void stop_engine(engine_t *engine) {
+    if (engine->handle) {
+        TextToSpeechShutdown(engine->handle);
+        engine->handle = NULL;
     }
+    free_stream_buffers(engine);
+    free(engine->capture.data);
+    free(engine->held);
+}
 
-    // Print audio device info
-    PaDeviceIndex numDevices = Pa_GetDeviceCount();
-    printf("Number of audio devices: %d\n", numDevices);
-    PaDeviceIndex defaultOutput = Pa_GetDefaultOutputDevice();
-    const PaDeviceInfo* deviceInfo = Pa_GetDeviceInfo(defaultOutput);
-    printf("Default output device: %s\n", deviceInfo->name);
+// Starts engine_count synthesis engines
+int start_engines(void) {
+    for (int i = 0; i < engine_count; i++) {
+        char name[sizeof(engines[0].name)];
+        snprintf(name, sizeof(name), "synthesis %d", i);
+        if (start_engine(i, name) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    // Open PortAudio stream
-    PaStreamParameters outputParameters;
-    outputParameters.device = defaultOutput;
-    outputParameters.channelCount = 2;  // Stereo output
-    outputParameters.sampleFormat = paFloat32;
-    outputParameters.suggestedLatency = deviceInfo->defaultLowOutputLatency;
-    outputParameters.hostApiSpecificStreamInfo = NULL;
+void stop_engines(void) {
+    for (int i = 0; i < engine_count; i++) {
+        stop_engine(&engines[i]);
+    }
+}
 
-    // TODO: remove hardcoded rate
-    err = Pa_OpenStream(&audio_stream,
-                        NULL,  // No input
-                        &outputParameters,
-                        11025,  // Sample rate
-                        256,    // Frames per buffer
-                        paClipOff,
-                        audio_callback,
-                        NULL);
-    if (err != paNoError) {
-        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
-        return 1;
+// Starts the letter bank's engine and thread and queues the first render.
+// Without them l still works, just without the bank.
+void start_letter_bank(void) {
+    if (!letter_bank_enabled) {
+        return;
+    }
+    if (start_engine(LETTER_ENGINE, "letter bank") != 0) {
+        letter_bank_enabled = 0;
+        return;
+    }
+    engines[LETTER_ENGINE].render_only = 1;
+    uv_mutex_init(&letter_mutex);
+    uv_cond_init(&letter_cond);
+    atomic_store(&letter_running, 1);
+    int r = uv_thread_create(&letter_thread, letter_worker, &engines[LETTER_ENGINE]);
+    if (r) {
+        fprintf(stderr, "Letter bank thread error %s\n", uv_strerror(r));
+        stop_engine(&engines[LETTER_ENGINE]);
+        letter_bank_enabled = 0;
+        return;
     }
+    letter_bank_refresh();
+}
 
-    err = Pa_StartStream(audio_stream);
-    if (err != paNoError) {
-        fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
-        return 1;
+void stop_letter_bank(void) {
+    if (!letter_bank_enabled) {
+        return;
     }
+    uv_mutex_lock(&letter_mutex);
+    atomic_store(&letter_running, 0);
+    uv_cond_signal(&letter_cond);
+    uv_mutex_unlock(&letter_mutex);
+    uv_thread_join(&letter_thread);
+    letter_bank_reset(&letter_target);
+    stop_engine(&engines[LETTER_ENGINE]);
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--no-stream] [--chunk-frames N] [--audio-budget-ms N] [--text-budget BYTES]\n"
+                    "          [--sink portaudio|null|wav] [--wav-file PATH] [--unthrottled] [--trace FILE]\n"
+                    "          [--cache-mb N] [--no-cache] [--phrase-cache FILE] [--phrase-cache-mb N]\n"
+                    "          [--dictionary PATH] [--engines N] [--split-chars N] [--no-split]\n"
+                    "          [--max-line BYTES] [--pcm-blocks N] [--output-rate HZ]\n"
+                    "          [--resample-quality low|medium|high] [--icons DIR] [--no-letter-bank] [--port N]\n", program);
+}
 
-    printf("PortAudio stream started\n");
+// Parses a positive decimal count
+int parse_count(const char *arg, unsigned long *value) {
+    char *end;
+    unsigned long parsed = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || parsed == 0) {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
 
-    loop = uv_default_loop();
+int parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-stream") == 0) {
+            streaming_enabled = 0;
+        } else if (strcmp(argv[i], "--sink") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, portaudio_sink.name) == 0) {
+                audio_sink = &portaudio_sink;
+            } else if (strcmp(name, null_sink.name) == 0) {
+                audio_sink = &null_sink;
+            } else if (strcmp(name, wav_sink.name) == 0) {
+                audio_sink = &wav_sink;
+            } else {
+                fprintf(stderr, "Unknown audio sink: %s\n", name);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--wav-file") == 0 && i + 1 < argc) {
+            wav_file_path = argv[++i];
+        } else if (strcmp(argv[i], "--unthrottled") == 0) {
+            sink_realtime = 0;
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            unsigned long mb;
+            if (parse_count(argv[++i], &mb) != 0) {
+                fprintf(stderr, "Invalid cache size: %s\n", argv[i]);
+                return -1;
+            }
+            cache_budget = (size_t)mb * 1024 * 1024;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            cache_budget = 0;
+        } else if (strcmp(argv[i], "--phrase-cache") == 0 && i + 1 < argc) {
+            phrase_cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--phrase-cache-mb") == 0 && i + 1 < argc) {
+            unsigned long mb;
+            if (parse_count(argv[++i], &mb) != 0) {
+                fprintf(stderr, "Invalid phrase cache size: %s\n", argv[i]);
+                return -1;
+            }
+            phrase_cache_size = (size_t)mb * 1024 * 1024;
+        } else if (strcmp(argv[i], "--icons") == 0 && i + 1 < argc) {
+            icon_dir = argv[++i];
+        } else if (strcmp(argv[i], "--dictionary") == 0 && i + 1 < argc) {
+            dictionary_path = argv[++i];
+        } else if (strcmp(argv[i], "--split-chars") == 0 && i + 1 < argc) {
+            unsigned long chars;
+            if (parse_count(argv[++i], &chars) != 0) {
+                fprintf(stderr, "Invalid split length: %s\n", argv[i]);
+                return -1;
+            }
+            split_chars = chars;
+        } else if (strcmp(argv[i], "--max-line") == 0 && i + 1 < argc) {
+            unsigned long bytes;
+            if (parse_count(argv[++i], &bytes) != 0) {
+                fprintf(stderr, "Invalid line limit: %s\n", argv[i]);
+                return -1;
+            }
+            max_line_length = bytes;
+        } else if (strcmp(argv[i], "--pcm-blocks") == 0 && i + 1 < argc) {
+            unsigned long blocks;
+            if (parse_count(argv[++i], &blocks) != 0) {
+                fprintf(stderr, "Invalid PCM block count: %s\n", argv[i]);
+                return -1;
+            }
+            pcm_block_count = blocks;
+        } else if (strcmp(argv[i], "--output-rate") == 0 && i + 1 < argc) {
+            unsigned long rate;
+            if (parse_count(argv[++i], &rate) != 0 || rate < 8000 || rate > 192000) {
+                fprintf(stderr, "Output rate must be between 8000 and 192000 Hz: %s\n", argv[i]);
+                return -1;
+            }
+            output_rate = (unsigned int)rate;
+        } else if (strcmp(argv[i], "--resample-quality") == 0 && i + 1 < argc) {
+            const char *quality = argv[++i];
+            if (strcmp(quality, "low") == 0) {
+                resample_taps = 8;
+            } else if (strcmp(quality, "medium") == 0) {
+                resample_taps = 16;
+            } else if (strcmp(quality, "high") == 0) {
+                resample_taps = MAX_RESAMPLE_TAPS;
+            } else {
+                fprintf(stderr, "Unknown resample quality: %s\n", quality);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--no-letter-bank") == 0) {
+            letter_bank_enabled = 0;
+        } else if (strcmp(argv[i], "--no-split") == 0) {
+            split_chars = 0;
+        } else if (strcmp(argv[i], "--engines") == 0 && i + 1 < argc) {
+            unsigned long count;
+            if (parse_count(argv[++i], &count) != 0 || count > MAX_ENGINES) {
+                fprintf(stderr, "Engine count must be between 1 and %d: %s\n", MAX_ENGINES, argv[i]);
+                return -1;
+            }
+            engine_count = (int)count;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file_path = argv[++i];
+        } else if (strcmp(argv[i], "--chunk-frames") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &stream_chunk_frames) != 0 || stream_chunk_frames < MIN_CHUNK_FRAMES) {
+                fprintf(stderr, "Chunk size must be at least %d frames: %s\n", MIN_CHUNK_FRAMES, argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--audio-budget-ms") == 0 && i + 1 < argc) {
+            if (parse_count(argv[++i], &audio_budget_ms) != 0) {
+                fprintf(stderr, "Invalid audio budget: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--text-budget") == 0 && i + 1 < argc) {
+            unsigned long bytes;
+            if (parse_count(argv[++i], &bytes) != 0) {
+                fprintf(stderr, "Invalid text budget: %s\n", argv[i]);
+                return -1;
+            }
+            text_budget = bytes;
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            unsigned long port;
+            if (parse_count(argv[++i], &port) != 0 || port > 65535) {
+                fprintf(stderr, "Port must be between 1 and 65535: %s\n", argv[i]);
+                return -1;
+            }
+            server_port = (int)port;
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Brings up synthesis and playback in dependency order: engines, then the
+// queues the audio thread reads, then the sink, then the threads that fill
+// the queues.
+int start_pipeline(void) {
+    if (start_engines() != 0) {
+        return -1;
+    }
+    TextToSpeechVersion(&dectalk_version);
+
+    // Must follow TextToSpeechVersion, which the file is validated against
+    if (phrase_cache_path && phrase_cache_open(phrase_cache_path, phrase_cache_size, dictionary_path) != 0) {
+        phrase_cache_path = NULL;
+    }
+
+    if (init_queues() != 0) {
+        return -1;
+    }
+
+    if (audio_sink->start() != 0) {
+        if (audio_sink != &portaudio_sink) {
+            return -1;
+        }
+        fprintf(stderr, "Falling back to the null audio sink\n");
+        audio_sink = &null_sink;
+        if (audio_sink->start() != 0) {
+            return -1;
+        }
+    }
+
+    // Icons are stored at the rate the sink settled on
+    if (icon_dir && icon_preload(icon_dir) != 0) {
+        audio_sink->stop();
+        return -1;
+    }
+
+    int r = start_synth_worker();
+    if (r) {
+        fprintf(stderr, "Synthesis worker error %s\n", uv_strerror(r));
+        return -1;
+    }
+    start_letter_bank();
+    return 0;
+}
+
+// Lets the engines finish what is queued and stops playback
+void stop_pipeline(void) {
+    stop_synth_worker();
+    audio_sink->stop();
+}
+
+// Frees everything start_pipeline set up, once stop_pipeline has returned
+void free_pipeline(void) {
+    stop_letter_bank();
+
+    audio_item_t item;
+    while (audio_ring_pop(&audio_ring, &item) == 0) {
+        release_item_data(&item);
+    }
+    while (audio_ring_pop(&effect_ring, &item) == 0) {
+        release_item_data(&item);
+    }
+    for (int i = 0; i < MAX_MIX_VOICES; i++) {
+        if (mix_voices[i].active) {
+            release_item_data(&mix_voices[i].item);
+        }
+    }
+    reclaim_audio_items();
+    icon_bank_free();
+    stop_engines();
+    free(pending_speech.data);
+    free(synth_queue);
+    cache_clear();
+    phrase_cache_close();
+    free(audio_ring.items);
+    free(reclaim_ring.items);
+    free(effect_ring.items);
+    block_pool_destroy(&pcm_pool);
+    block_pool_destroy(&text_pool);
+    free(resampler.coeffs);
+}
 
-    uv_mutex_init(&audio_queue_mutex);
-    uv_cond_init(&audio_queue_cond);
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+    trace_register_thread("main");
+    if (start_tracing() != 0) {
+        return 1;
+    }
+    loop = uv_default_loop();
+    if (start_pipeline() != 0) {
+        return 1;
+    }
+    int r;
 
     uv_tcp_t server;
     uv_tcp_init(loop, &server);
 
     struct sockaddr_in addr;
-    uv_ip4_addr("0.0.0.0", DEFAULT_PORT, &addr);
+    uv_ip4_addr("0.0.0.0", server_port, &addr);
 
     uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
-    int r = uv_listen((uv_stream_t*)&server, DEFAULT_BACKLOG, on_new_connection);
+    r = uv_listen((uv_stream_t*)&server, DEFAULT_BACKLOG, on_new_connection);
     if (r) {
         fprintf(stderr, "Listen error %s\n", uv_strerror(r));
         return 1;
     }
 
-    // Set up STDIN handling
-    uv_pipe_t stdin_pipe;
-    uv_pipe_init(loop, &stdin_pipe, 0);
-    uv_pipe_open(&stdin_pipe, 0);
-    uv_read_start((uv_stream_t*)&stdin_pipe, alloc_buffer, stdin_read);
+    uv_timer_init(loop, &resume_timer);
+
+    // Set up STDIN handling. A file or /dev/null can't be polled, which
+    // libuv treats as fatal, so headless runs serve TCP only.
+    uv_handle_type stdin_type = uv_guess_handle(0);
+    if (stdin_type == UV_NAMED_PIPE || stdin_type == UV_TTY) {
+        client_t *stdin_client = add_client();
+        if (!stdin_client) {
+            fprintf(stderr, "Out of memory setting up stdin\n");
+            return 1;
+        }
+        uv_pipe_init(loop, &stdin_client->handle.pipe, 0);
+        stdin_client->handle.stream.data = stdin_client;
+        uv_pipe_open(&stdin_client->handle.pipe, 0);
+        start_client(stdin_client);
+    }
 
     // Set up PortAudio stream check timer
     uv_timer_t check_audio_timer;
     uv_timer_init(loop, &check_audio_timer);
     uv_timer_start(&check_audio_timer, check_portaudio_stream, 0, 5000); // Check every 5 seconds
 
-    printf("Server listening on port %d\n", DEFAULT_PORT);
-    printf("Use 'ttssay <text>' to speak text\n");
+    // SIGINT/SIGTERM shut down cleanly; SIGUSR1 dumps metrics
+    uv_signal_t sigint_handle, sigterm_handle;
+    uv_signal_init(loop, &sigint_handle);
+    uv_signal_start(&sigint_handle, on_signal, SIGINT);
+    uv_signal_init(loop, &sigterm_handle);
+    uv_signal_start(&sigterm_handle, on_signal, SIGTERM);
+#ifdef SIGUSR1
+    uv_signal_t sigusr1_handle;
+    uv_signal_init(loop, &sigusr1_handle);
+    uv_signal_start(&sigusr1_handle, on_signal, SIGUSR1);
+#endif
+
+    printf("Server listening on port %d\n", server_port);
+    printf("Use 'tts_say {text}' to speak text\n");
 
     int run_result = uv_run(loop, UV_RUN_DEFAULT);
 
     // Cleanup
-    Pa_StopStream(audio_stream);
-    Pa_CloseStream(audio_stream);
-    Pa_Terminate();
+    stop_pipeline();
+    stop_tracing();
+
+    print_metrics(stderr);
+    free_pipeline();
 
-    return run_result;
+    return shutdown_requested ? 0 : run_result;
 }
@@ -0,0 +1,634 @@
+// Pipeline tests. omnivox.c is built into this program with its main
+// renamed, and each test drives it through feed_lines, the same parser
+// TCP and stdin clients use, with the null sink standing in for the sound
+// card. Each test runs in a process of its own: make test runs them all,
+// ./omnivox_test NAME runs one.
+
+// omnivox.c needs POSIX and BSD calls that C11 leaves out, and its own
+// request comes after the headers included here
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// Every allocation omnivox.c makes is counted. Libraries it calls into
+// keep their own allocators and are not.
+atomic_ulong allocations;
+
+void *counted_malloc(size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return malloc(size);
+}
+
+void *counted_calloc(size_t count, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return calloc(count, size);
+}
+
+void *counted_realloc(void *p, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return realloc(p, size);
+}
+
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(p, size) counted_realloc(p, size)
+#define main omnivox_main
+#include "../omnivox.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define WAIT_TIMEOUT_MS 10000
+#define STOP_LATENCY_LIMIT_MS 50.0  // Two buffers of the real-time null sink, with room for scheduling
+#define STOP_IDLE_LIMIT_MS 500.0
+#define STOP_RESTART_LIMIT_MS 1000.0
+#define STOP_RACE_ROUNDS 40
+#define STOP_RACE_STEP_NS 25000  // Each round stops this much later after the request
+#define ALLOC_ROUNDS 3  // The first rounds fill the caches and grow the queues
+#define PHRASE_TEST_SIZE (PHRASE_BLOBS_START + 64 * PHRASE_PAGE_SIZE)
+
+int failures = 0;
+line_buffer_t test_lines;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            failures++; \
+        } \
+    } while (0)
+
+double ms_since(uint64_t start) {
+    return (double)(uv_hrtime() - start) / 1e6;
+}
+
+// Feeds one protocol line as if a client had just sent it
+void send_line(const char *line) {
+    static char buffer[64 * 1024];
+    size_t len = strlen(line);
+    if (len + 1 > sizeof(buffer)) {
+        fprintf(stderr, "Test line too long\n");
+        exit(2);
+    }
+    memcpy(buffer, line, len);
+    buffer[len] = '\n';
+    line_received_at = uv_hrtime();
+    feed_lines(&test_lines, buffer, len + 1);
+}
+
+// Speaks text with tts_say
+void say(const char *text) {
+    static char line[64 * 1024];
+    snprintf(line, sizeof(line), "tts_say {%s}", text);
+    send_line(line);
+}
+
+// Nothing queued, synthesizing or waiting to play
+int pipeline_idle(void) {
+    uv_mutex_lock(&synth_queue_mutex);
+    int idle = synth_queue_size == 0;
+    uv_mutex_unlock(&synth_queue_mutex);
+    for (int i = 0; i < engine_count; i++) {
+        idle = idle && !atomic_load(&engines[i].busy);
+    }
+    return idle && audio_ring_depth(&audio_ring) == 0 && atomic_load(&queued_audio_frames) == 0;
+}
+
+int wait_until_idle(double timeout_ms) {
+    uint64_t start = uv_hrtime();
+    while (!pipeline_idle()) {
+        if (ms_since(start) > timeout_ms) {
+            return -1;
+        }
+        uv_sleep(1);
+    }
+    return 0;
+}
+
+unsigned long first_samples(void) {
+    return atomic_load(&stage_latency[STAGE_FIRST_SAMPLE].total);
+}
+
+// Waits until more than count requests have played a first sample
+int wait_for_first_sample(unsigned long count, double timeout_ms) {
+    uint64_t start = uv_hrtime();
+    while (first_samples() <= count) {
+        if (ms_since(start) > timeout_ms) {
+            return -1;
+        }
+        uv_sleep(1);
+    }
+    return 0;
+}
+
+// Text long enough to keep an engine synthesizing well past a stop
+char *long_text(size_t bytes) {
+    static const char sentence[] = "The quick brown fox jumps over the lazy dog near the riverbank. ";
+    char *text = malloc(bytes + 1);
+    if (!text) {
+        exit(2);
+    }
+    for (size_t i = 0; i < bytes; i++) {
+        text[i] = sentence[i % (sizeof(sentence) - 1)];
+    }
+    text[bytes] = '\0';
+    return text;
+}
+
+int start_test_pipeline(char **options, int count) {
+    if (parse_options(count, options) != 0) {
+        return -1;
+    }
+    trace_register_thread("test");
+    loop = uv_default_loop();
+    return start_pipeline();
+}
+
+void finish_test_pipeline(void) {
+    stop_pipeline();
+    free_pipeline();
+    free(test_lines.data);
+}
+
+// s must silence playback within a buffer or two, cancel the synthesis in
+// flight, and let the next utterance start at once, including when the
+// stop lands before an engine has started speaking the text it took.
+void test_stop(void) {
+    char *options[] = { "omnivox_test", "--sink", "null", "--no-split", "--no-cache", "--no-letter-bank" };
+    if (start_test_pipeline(options, (int)(sizeof(options) / sizeof(options[0]))) != 0) {
+        CHECK(0, "pipeline did not start");
+        return;
+    }
+    char *text = long_text(3000);
+
+    // Stop while speech is playing
+    unsigned long played = first_samples();
+    say(text);
+    CHECK(wait_for_first_sample(played, WAIT_TIMEOUT_MS) == 0, "speech never started playing");
+    uv_sleep(100);
+    atomic_store(&metrics.stop_latency_last_ns, 0);
+    uint64_t stopped_at = uv_hrtime();
+    send_line("s");
+    while (atomic_load(&metrics.stop_latency_last_ns) == 0 && ms_since(stopped_at) < WAIT_TIMEOUT_MS) {
+        uv_sleep(1);
+    }
+    double silence_ms = (double)atomic_load(&metrics.stop_latency_last_ns) / 1e6;
+    CHECK(silence_ms > 0.0 && silence_ms < STOP_LATENCY_LIMIT_MS,
+          "stop-to-silence took %.3f ms, limit %.0f ms", silence_ms, STOP_LATENCY_LIMIT_MS);
+    CHECK(wait_until_idle(STOP_IDLE_LIMIT_MS) == 0, "synthesis still running %.0f ms after stop", STOP_IDLE_LIMIT_MS);
+    double idle_ms = ms_since(stopped_at);
+    printf("stop during playback: silence after %.3f ms, engines idle after %.3f ms\n", silence_ms, idle_ms);
+
+    // Stop right behind the request, racing the engine that takes it. The
+    // delay sweeps the stop across taking the request, opening DECtalk's
+    // in-memory session and starting Speak.
+    double worst_ms = 0.0;
+    for (int round = 0; round < STOP_RACE_ROUNDS; round++) {
+        say(text);
+        uint64_t stop_at = uv_hrtime() + (uint64_t)round * STOP_RACE_STEP_NS;
+        while (uv_hrtime() < stop_at) {
+        }
+        send_line("s");
+        played = first_samples();
+        uint64_t start = uv_hrtime();
+        say("after");
+        CHECK(wait_for_first_sample(played, WAIT_TIMEOUT_MS) == 0, "round %d: speech after a stop never played", round);
+        double restart_ms = ms_since(start);
+        worst_ms = restart_ms > worst_ms ? restart_ms : worst_ms;
+        CHECK(restart_ms < STOP_RESTART_LIMIT_MS, "round %d: speech after a stop waited %.3f ms", round, restart_ms);
+        CHECK(wait_until_idle(WAIT_TIMEOUT_MS) == 0, "round %d: pipeline never went idle", round);
+    }
+    printf("stop racing synthesis: next utterance audible after at most %.3f ms over %d rounds\n",
+           worst_ms, STOP_RACE_ROUNDS);
+
+    free(text);
+    finish_test_pipeline();
+}
+
+// One round of a session: keystroke echo, short phrases that hit the
+// cache, a paragraph too long to cache that is split into chunks, a
+// queued batch, tones and silence.
+void alloc_round(const char *paragraph) {
+    static const char *const words[] = { "open", "file", "buffer", "saved", "next line", "mark set" };
+    static const char letters[] = "emacspeak";
+    for (size_t i = 0; i < sizeof(letters) - 1; i++) {
+        char line[8];
+        snprintf(line, sizeof(line), "l %c", letters[i]);
+        send_line(line);
+    }
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        say(words[i]);
+    }
+    say(paragraph);
+    send_line("q {first queued}");
+    send_line("c {x = y + 1;}");
+    send_line("q {second queued}");
+    send_line("t 440 20");
+    send_line("sh 20");
+    send_line("d");
+}
+
+// After warmup, speaking must not allocate: text goes into the request
+// pool, audio into the PCM pool, and cache hits share cached audio.
+void test_alloc(void) {
+    char *options[] = { "omnivox_test", "--sink", "null", "--unthrottled", "--no-letter-bank" };
+    if (start_test_pipeline(options, (int)(sizeof(options) / sizeof(options[0]))) != 0) {
+        CHECK(0, "pipeline did not start");
+        return;
+    }
+    char *paragraph = long_text(1500);
+    unsigned long counted[ALLOC_ROUNDS];
+    for (int round = 0; round < ALLOC_ROUNDS; round++) {
+        unsigned long before = atomic_load(&allocations);
+        alloc_round(paragraph);
+        CHECK(wait_until_idle(WAIT_TIMEOUT_MS) == 0, "round %d: pipeline never went idle", round);
+        counted[round] = atomic_load(&allocations) - before;
+    }
+    printf("allocations per round:");
+    for (int round = 0; round < ALLOC_ROUNDS; round++) {
+        printf(" %lu", counted[round]);
+    }
+    printf("\n");
+    CHECK(counted[ALLOC_ROUNDS - 1] == 0, "%lu allocations after warmup", counted[ALLOC_ROUNDS - 1]);
+    CHECK(atomic_load(&pcm_pool.fallbacks) == 0, "%lu PCM blocks fell back to malloc",
+          (unsigned long)atomic_load(&pcm_pool.fallbacks));
+
+    free(paragraph);
+    finish_test_pipeline();
+}
+
+int phrase_count(void) {
+    int count = 0;
+    for (int32_t i = 0; i < PHRASE_SLOTS; i++) {
+        count += phrase_slots[i].text_len > 0;
+    }
+    return count;
+}
+
+// Stores two phrases, lets damage break the file, and reopens it
+int phrase_reopen(const char *path, void (*damage)(void)) {
+    static int16_t pcm[3000];
+    voice_state_t voice = current_voice;
+    if (phrase_cache_open(path, PHRASE_TEST_SIZE, "/nonexistent") != 0) {
+        return -1;
+    }
+    phrase_cache_store("first phrase", &voice, pcm, 3000);
+    phrase_cache_store("second phrase", &voice, pcm, 1000);
+    if (damage) {
+        damage();
+    }
+    phrase_cache_close();
+    return phrase_cache_open(path, PHRASE_TEST_SIZE, "/nonexistent");
+}
+
+void damage_offset(void) {
+    phrase_slots[0].offset = PHRASE_TEST_SIZE - PHRASE_PAGE_SIZE;
+}
+
+void damage_before_blobs(void) {
+    phrase_slots[1].offset = PHRASE_PAGE_SIZE;
+}
+
+void damage_text(void) {
+    memset(phrase_slots[0].text, 'x', sizeof(phrase_slots[0].text));
+}
+
+void damage_length(void) {
+    phrase_slots[1].text_len = 1000;
+}
+
+void damage_overlap(void) {
+    phrase_slots[1].offset = phrase_slots[0].offset + PHRASE_PAGE_SIZE;
+}
+
+// A phrase file that passes the header check but holds a damaged slot
+// is rebuilt empty instead of being read out of bounds. Stores keep the
+// blobs in order without overlaps as they evict.
+void test_phrase(void) {
+    static const struct {
+        const char *name;
+        void (*damage)(void);
+    } cases[] = {
+        { "blob past the end", damage_offset },
+        { "blob inside the index", damage_before_blobs },
+        { "unterminated text", damage_text },
+        { "text length too long", damage_length },
+        { "overlapping blobs", damage_overlap },
+    };
+    char path[] = "/tmp/omnivox_test_phrase_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        CHECK(0, "cannot create %s", path);
+        return;
+    }
+    close(fd);
+
+    static int16_t pcm[3000];
+    voice_state_t voice = current_voice;
+    CHECK(phrase_reopen(path, NULL) == 0, "intact file did not open");
+    CHECK(phrase_count() == 2, "intact file kept %d of 2 phrases", phrase_count());
+    CHECK(phrase_find("first phrase", &voice) >= 0, "intact file lost a phrase");
+    voice_state_t paul = voice;
+    paul.inline_voice = 1;
+    CHECK(phrase_find("first phrase", &paul) < 0, "phrase found under another inline voice");
+    phrase_cache_close();
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        unlink(path);
+        CHECK(phrase_reopen(path, cases[i].damage) == 0, "%s: file did not open", cases[i].name);
+        CHECK(phrase_count() == 0, "%s: %d phrases survived", cases[i].name, phrase_count());
+        phrase_cache_store("first phrase", &voice, pcm, 3000);
+        CHECK(phrase_count() == 1, "%s: rebuilt file does not take phrases", cases[i].name);
+        phrase_cache_close();
+    }
+
+    // Churn: the blob list stays in order through evictions, and a phrase
+    // that has been played outlives a run of one-off text
+    unlink(path);
+    static int16_t long_pcm[4 * PHRASE_PAGE_SIZE / sizeof(int16_t)];
+    CHECK(phrase_cache_open(path, PHRASE_TEST_SIZE, "/nonexistent") == 0, "churn: file did not open");
+    phrase_cache_store("played phrase", &voice, pcm, 3000);
+    int32_t played = phrase_find("played phrase", &voice);
+    if (played >= 0) {
+        phrase_slots[played].uses++;
+    }
+    for (int i = 0; i < 200; i++) {
+        char text[32];
+        snprintf(text, sizeof(text), "one-off %d", i);
+        phrase_cache_store(text, &voice, long_pcm, (sf_count_t)((1 + i % 4) * PHRASE_PAGE_SIZE / 2 - 1));
+    }
+    int linked = 0;
+    uint64_t end = PHRASE_BLOBS_START;
+    for (int32_t slot = phrase_first_blob; slot >= 0; slot = phrase_next_blob[slot]) {
+        CHECK(phrase_slots[slot].offset >= end, "churn: blob list out of order at slot %d", slot);
+        end = phrase_blob_end(&phrase_slots[slot]);
+        linked++;
+    }
+    CHECK(linked == phrase_count(), "churn: %d blobs linked for %d phrases", linked, phrase_count());
+    CHECK(phrase_slots_valid(), "churn: blobs overlap");
+    CHECK(phrase_find("played phrase", &voice) >= 0, "churn: played phrase was evicted");
+    phrase_cache_close();
+    unlink(path);
+}
+
+// Queued chunk index's text; only valid while no engine is running
+const char *queued_chunk(size_t index) {
+    return synth_queue[(synth_queue_head + index) % synth_queue_capacity].text;
+}
+
+// A remainder that fits the limit goes out whole as the last chunk.
+// Chunks after the first repeat the settings in force, the last of each
+// kind, and never one-off commands like tones or index marks, however
+// many of those the text holds.
+void test_split(void) {
+    if (init_queues() != 0) {
+        CHECK(0, "queues did not start");
+        return;
+    }
+    letter_bank_enabled = 0;
+    split_chars = 200;
+    static char text[8192];
+    size_t len = 0;
+    for (int i = 0; i < 11; i++) {
+        len += (size_t)snprintf(text + len, sizeof(text) - len, "%sSentence %d is short.", i ? " " : "", i);
+    }
+    CHECK(enqueue_speech(text) == 0, "text was not queued");
+    CHECK(synth_queue_size == 2, "%zu chunks where a short first one and the rest were expected", synth_queue_size);
+    if (synth_queue_size == 2) {
+        const char *rest = strstr(text, "Sentence 2");
+        CHECK(strcmp(queued_chunk(1), rest) == 0, "last chunk is not the whole remainder: %s", queued_chunk(1));
+    }
+    flush_synth_queue();
+
+    len = (size_t)snprintf(text, sizeof(text),
+                                  "[:np][:ra 300][:dv ap 120] Paul starts fast. [:tone 440 50]Beep. [:index mark 1]");
+    for (int i = 0; i < 40; i++) {
+        len += (size_t)snprintf(text + len, sizeof(text) - len,
+                                "Sentence %d is here[:tone %d 10] with a tone. ", i, 400 + i);
+    }
+    len += (size_t)snprintf(text + len, sizeof(text) - len,
+                            "[:nh :RA 180][:punct all] Harry slows down. ");
+    for (int i = 0; i < 10; i++) {
+        len += (size_t)snprintf(text + len, sizeof(text) - len, "Harry reads line %d of the buffer. ", i);
+    }
+    CHECK(enqueue_speech(text) == 0, "text was not queued");
+
+    size_t chunks = synth_queue_size;
+    CHECK(chunks > 10, "text was split into %zu chunks", chunks);
+    int tones = 0, marks = 0;
+    for (size_t i = 0; i < chunks; i++) {
+        const char *chunk = queued_chunk(i);
+        for (const char *p = strstr(chunk, "[:tone"); p; p = strstr(p + 1, "[:tone")) {
+            tones++;
+        }
+        for (const char *p = strstr(chunk, "[:index"); p; p = strstr(p + 1, "[:index")) {
+            marks++;
+        }
+        if (i == 0) {
+            continue;
+        }
+        CHECK(strncmp(chunk, "[:np][:dv ap 120][:ra 300]", 26) == 0 || strncmp(chunk, "[:nh][:RA 180]", 14) == 0,
+              "chunk %zu starts without the settings in force: %.60s", i, chunk);
+        CHECK(strncmp(chunk, "[:nh]", 5) != 0 || strstr(chunk, "dv") == NULL,
+              "chunk %zu keeps Paul's design for Harry", i);
+    }
+    CHECK(tones == 41 && marks == 1, "41 tones and 1 index mark came out as %d and %d", tones, marks);
+    const char *last = queued_chunk(chunks - 1);
+    CHECK(strncmp(last, "[:nh][:RA 180][:punct all]", 26) == 0,
+          "last chunk does not carry the final settings: %.60s", last);
+    printf("split into %zu chunks; last starts %.40s\n", chunks, last);
+    flush_synth_queue();
+}
+
+// Voice commands in earlier speech are part of the cache key of what
+// follows, and a command the key cannot describe keeps what follows out of
+// the caches. The letter bank follows the voice, and a capital restores
+// the voice in force after raising the pitch.
+void test_voice(void) {
+    if (init_queues() != 0) {
+        CHECK(0, "queues did not start");
+        return;
+    }
+    // The bank's thread is not started, but its target still follows
+    uv_mutex_init(&letter_mutex);
+    uv_cond_init(&letter_cond);
+    say("Hello there.");
+    say("[:np :ra 300]");
+    say("Hello there.");
+    say("[:dv ap 140]");
+    say("Hello there.");
+    say("[:phoneme arpabet speak on]");
+    say("Hello there.");
+    CHECK(synth_queue_size == 7, "%zu of 7 requests queued", synth_queue_size);
+
+    const voice_state_t *plain = &synth_queue[synth_queue_head].voice;
+    const voice_state_t *paul = &synth_queue[(synth_queue_head + 2) % synth_queue_capacity].voice;
+    const voice_state_t *designed = &synth_queue[(synth_queue_head + 4) % synth_queue_capacity].voice;
+    const voice_state_t *unknown = &synth_queue[(synth_queue_head + 6) % synth_queue_capacity].voice;
+    CHECK(plain->inline_voice == 0, "speech before any voice command has an inline voice");
+    CHECK(!same_voice(plain, paul) && utterance_hash("Hello there.", plain) != utterance_hash("Hello there.", paul),
+          "[:np] does not change the cache key");
+    CHECK(!same_voice(paul, designed), "[:dv] does not change the cache key");
+    CHECK(voice_cacheable(designed), "a voice the key describes is not cached");
+    CHECK(!voice_cacheable(unknown), "speech after an untracked command is cached");
+    voice_state_t target = letter_voice(designed);
+    CHECK(same_voice(&letter_target, &target) && strcmp(letter_target_carry.setting[CARRY_VOICE], "np") == 0,
+          "the letter bank was not retargeted at the designed voice");
+
+    voice_state_t capitals = *designed;
+    capitals.capitalize = 1;
+    char spoken[LETTER_TEXT_MAX];
+    letter_text('A', &capitals, &voice_carry, spoken, sizeof(spoken));
+    CHECK(strcmp(spoken, "[:dv ap 160][:say letter]A[:say clause][:np][:dv ap 140]") == 0,
+          "capital A does not restore the voice in force: %s", spoken);
+    flush_synth_queue();
+    free(test_lines.data);
+}
+
+// An inline voice command changes only the engine that speaks it. With two
+// engines, each later request repeats the voice in force, so both sound
+// the same whichever engine takes them.
+void test_engines(void) {
+    char *options[] = { "omnivox_test", "--engines", "2", "--no-letter-bank" };
+    if (parse_options((int)(sizeof(options) / sizeof(options[0])), options) != 0 || init_queues() != 0) {
+        CHECK(0, "queues did not start");
+        return;
+    }
+    send_line("q {[:np]}");
+    send_line("d");
+    send_line("q {First request.}");
+    send_line("d");
+    send_line("q {Second request.}");
+    send_line("d");
+    CHECK(synth_queue_size == 3, "%zu of 3 requests queued", synth_queue_size);
+    for (size_t i = 1; i < synth_queue_size; i++) {
+        CHECK(strncmp(queued_chunk(i), "[:np]", 5) == 0, "request %zu does not start in Paul's voice: %s", i,
+              queued_chunk(i));
+    }
+    const voice_state_t *first = &synth_queue[(synth_queue_head + 1) % synth_queue_capacity].voice;
+    const voice_state_t *second = &synth_queue[(synth_queue_head + 2) % synth_queue_capacity].voice;
+    CHECK(same_voice(first, second), "the two requests were queued in different voices");
+    flush_synth_queue();
+    free(pending_speech.data);
+    free(test_lines.data);
+}
+
+// q and c fragments batch into one call joined by plain spaces, with no
+// punctuation added after code or between pieces of one sentence.
+void test_batch(void) {
+    send_line("q {The file}");
+    send_line("c {[:np]}");
+    send_line("q {was saved}");
+    send_line("q {to disk.}");
+    send_line("c {[:tone 440 50]}");
+    const char *expected = "The file [:np] was saved to disk. [:tone 440 50]";
+    CHECK(pending_speech.fragments == 5, "%lu of 5 fragments batched", pending_speech.fragments);
+    CHECK(pending_speech.len == strlen(expected) && strcmp(pending_speech.data, expected) == 0,
+          "batched \"%s\", expected \"%s\"", pending_speech.data, expected);
+    discard_pending_speech();
+    free(pending_speech.data);
+    free(test_lines.data);
+}
+
+// Writes seconds of a sine at frequency Hz, amplitude 0.5, as a WAV file
+int write_sine(const char *path, int rate, double frequency, double seconds) {
+    SF_INFO info = { .samplerate = rate, .channels = 1, .format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 };
+    SNDFILE *file = sf_open(path, SFM_WRITE, &info);
+    if (!file) {
+        return -1;
+    }
+    sf_count_t frames = (sf_count_t)(rate * seconds);
+    for (sf_count_t i = 0; i < frames; i++) {
+        float sample = (float)(0.5 * sin(2.0 * RESAMPLE_PI * frequency * (double)i / rate));
+        sf_writef_float(file, &sample, 1);
+    }
+    sf_close(file);
+    return 0;
+}
+
+// Icons are stored at the output rate, keeping content DECtalk's rate
+// would cut, and a file that cannot be played is tried only once.
+void test_icon(void) {
+    output_rate = 48000;
+    char path[] = "/tmp/omnivox_test_icon_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        CHECK(0, "cannot create %s", path);
+        return;
+    }
+    close(fd);
+    CHECK(write_sine(path, 44100, 8000.0, 0.25) == 0, "cannot write %s", path);
+
+    icon_t *icon = icon_lookup(path);
+    CHECK(icon != NULL, "8 kHz icon did not load");
+    if (icon) {
+        CHECK(icon->frames >= 11990 && icon->frames <= 12010, "0.25 s stored as %ld frames at 48 kHz",
+              (long)icon->frames);
+        // Away from the edges an 8 kHz sine of amplitude 0.5 keeps its RMS
+        double sum = 0.0;
+        sf_count_t count = 0;
+        for (sf_count_t i = 1000; i < icon->frames - 1000; i++, count++) {
+            double sample = icon->data[i] / 32768.0;
+            sum += sample * sample;
+        }
+        double rms = sqrt(sum / (double)count);
+        CHECK(fabs(rms - 0.5 / sqrt(2.0)) < 0.02, "8 kHz content came out at RMS %.3f", rms);
+        printf("8 kHz icon: %ld frames at %u Hz, RMS %.3f\n", (long)icon->frames, output_rate, rms);
+    }
+
+    const char *broken = "/tmp/omnivox_test_icon_missing.wav";
+    CHECK(icon_lookup(broken) == NULL, "missing icon loaded");
+    size_t loaded = icon_count;
+    CHECK(icon_lookup(broken) == NULL, "missing icon loaded on the second try");
+    icon_t *entry = icon_table[hash_bytes(0xcbf29ce484222325ULL, broken, strlen(broken)) & (ICON_TABLE_SIZE - 1)];
+    while (entry && strcmp(entry->path, broken) != 0) {
+        entry = entry->next;
+    }
+    CHECK(entry && !entry->data, "failed icon was not remembered");
+    CHECK(icon_count == loaded, "failed icon counted as loaded");
+    unlink(path);
+    icon_bank_free();
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+    { "stop", test_stop },
+    { "alloc", test_alloc },
+    { "phrase", test_phrase },
+    { "split", test_split },
+    { "voice", test_voice },
+    { "engines", test_engines },
+    { "batch", test_batch },
+    { "icon", test_icon },
+};
+
+int main(int argc, char **argv) {
+    size_t count = sizeof(tests) / sizeof(tests[0]);
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s TEST\nTests:", argv[0]);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(stderr, " %s", tests[i].name);
+        }
+        fputc('\n', stderr);
+        return 2;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(argv[1], tests[i].name) == 0) {
+            tests[i].run();
+            printf("%s: %s\n", tests[i].name, failures ? "FAIL" : "PASS");
+            return failures ? 1 : 0;
+        }
+    }
+    fprintf(stderr, "Unknown test: %s\n", argv[1]);
+    return 2;
+}